@@ -1,7 +1,11 @@
 #pragma once
 
+#include <memory>
+
 namespace Giza
 {
+class FixedPalette;
+
 struct ColorMapOptions
 {
   double quality = 10.0;  // 10 = good, 20 = poor
@@ -16,6 +20,37 @@ struct ColorMapOptions
   // solid 3x3 colour blocks. A value <= 0 implies no maximum.
   int maxcolors = 0;
 
+  // Find the quality for maxcolors with at most two passes over the colors
+  // instead of repeatedly reducing the quality by errorfactor. The first pass
+  // estimates the needed quality from the distances between the colors.
+  bool estimatequality = false;
+
   bool truecolor = false;  // true if truecolor is forced
+
+  // Choose the palette first and only then map the other colors to their
+  // nearest palette colors, using the threads below. Gives slightly better
+  // colors than mapping each color while the palette is still incomplete.
+  bool twophase = false;
+
+  // Reuse the color map of the previous image reduced by the same mapper or
+  // encoder if the colors it already maps cover at least this fraction of the
+  // pixels, for example 0.95 for consecutive time steps of the same product.
+  // Only the new colors are then reduced, which is much faster than building
+  // the whole color map but may choose slightly different colors. The default
+  // 0 disables the reuse.
+  double reusecoverage = 0;
+
+  // Map the colors to their nearest colors in a palette chosen by the caller,
+  // for example a legend or a palette shared by all tiles of a tile set,
+  // instead of choosing the palette for each image. The palette may be shared
+  // by many threads. The options above are then ignored, except truecolor
+  // and threads.
+  std::shared_ptr<const FixedPalette> palette;
+
+  // Number of worker threads used for scanning large images. The default 1
+  // keeps all processing in the calling thread, which is usually best when
+  // the server already encodes many images concurrently. A value <= 0 means
+  // one thread per hardware thread. The result does not depend on the value.
+  int threads = 1;
 };
 }  // namespace Giza
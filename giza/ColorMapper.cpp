@@ -1,13 +1,22 @@
 #include "ColorMapper.h"
 #include "ColorTree.h"
+#include "DenseColorMap.h"
+#include "FixedPalette.h"
+#include "Parallel.h"
+#include "Simd.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/version.hpp>
 #include <macgyver/Exception.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <deque>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <queue>
 #include <set>
 #include <unordered_map>
 #include <vector>
@@ -46,18 +55,89 @@ struct ColorInfo
     return *this;
   }
   void keep() { keeper = true; }
+
+  // Combine the statistics of the same color from another part of the image
+  void merge(const ColorInfo &other)
+  {
+    count += other.count;
+    keeper |= other.keeper;
+  }
 };
 
 // Internal histogram
 using ColorHistogram = std::vector<ColorInfo>;
 
+// Initial histogram table size limit, see calc_histogram
+constexpr std::size_t max_expected_colors = std::size_t{1} << 16;
+
+// Runs shorter than this are counted with a plain loop, longer ones with a
+// vectorized kernel whose call overhead pays off only for long runs.
+constexpr int short_run = 4;
+
+// Minimum number of pixels per band when scanning an image in parallel. Below
+// this the thread startup and the histogram merge cost more than they save.
+constexpr int min_band_pixels = 65536;
+
+// Minimum number of colors per thread when remapping colors in parallel
+constexpr int min_remap_colors = 4096;
+
+// Histograms at least this large are sorted with a radix sort instead of
+// std::sort. Measured crossover point, see colorhistogram().
+constexpr std::size_t min_radix_sort_size = 2048;
+
+// Images with many different alpha values or very transparent colors are
+// written in RGBA if they have at least this many colors.
+constexpr int max_unique_alphas = 100;
+constexpr unsigned char max_min_alpha = 128;
+constexpr std::size_t max_palette_size = 256;
+
+// The colors mapped to a fixed palette are remembered from one image to the
+// next, until there are this many
+constexpr std::size_t max_fixed_colors = 1000000;
+
+// A reused color map grows with the new colors of each image. It is built
+// again from scratch once it has this many colors.
+constexpr std::size_t max_reused_colors = 1000000;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Alpha statistics for choosing between palette and true color
+ *
+ * Both statistics change monotonically as colors are added, so once
+ * manyAlphas() is true it stays true.
+ */
+// ----------------------------------------------------------------------
+
+class AlphaStats
+{
+ public:
+  void add(Color color)
+  {
+    const auto a = alpha(color);
+    if (!itsSeen[a])
+    {
+      itsSeen[a] = true;
+      ++itsCount;
+    }
+    itsMinAlpha = std::min(itsMinAlpha, a);
+  }
+
+  // True if the image should not be color reduced but written as is
+  bool manyAlphas() const { return itsCount > max_unique_alphas || itsMinAlpha < max_min_alpha; }
+
+ private:
+  std::array<bool, 256> itsSeen{};
+  int itsCount = 0;
+  unsigned char itsMinAlpha = 255;
+};
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Open-addressing color histogram
  *
  * Maps each color to the index of its ColorInfo record. In both variants below
  * the records live in a std::deque, whose element addresses stay stable as it
- * grows: calc_histogram caches raw ColorInfo pointers (last1/last2) across
+ * grows: count_colors caches raw ColorInfo pointers (last1/last2) across
  * insertions and relies on that. The flat lookup table only ever stores indices
  * into the deque, so it is free to rehash and relocate without invalidating
  * those cached pointers.
@@ -72,6 +152,14 @@ class FlatHistogram
  public:
   explicit FlatHistogram(std::size_t expected) { itsIndex.reserve(expected); }
 
+  // Empty the histogram for a new image, keeping the allocated table
+  void reset(std::size_t expected)
+  {
+    itsIndex.clear();
+    itsIndex.reserve(expected);
+    itsEntries.clear();
+  }
+
   // Return the record for color, creating it (with count 0) if it is new.
   ColorInfo *get(Color color)
   {
@@ -82,6 +170,7 @@ class FlatHistogram
   }
 
   std::deque<ColorInfo> &entries() { return itsEntries; }
+  std::size_t size() const { return itsEntries.size(); }
 
  private:
   boost::unordered_flat_map<Color, uint32_t> itsIndex;
@@ -109,7 +198,10 @@ inline uint32_t color_hash(Color c)
 class FlatHistogram
 {
  public:
-  explicit FlatHistogram(std::size_t expected)
+  explicit FlatHistogram(std::size_t expected) { reset(expected); }
+
+  // Empty the histogram for a new image, keeping the allocated table
+  void reset(std::size_t expected)
   {
     std::size_t cap = 16;
     itsShift = 28;  // 32 - log2(16)
@@ -120,6 +212,7 @@ class FlatHistogram
     }
     itsSlots.assign(cap, Slot{EMPTY_SLOT, 0});
     itsMask = static_cast<uint32_t>(cap - 1);
+    itsEntries.clear();
   }
 
   // Return the record for color, creating it (with count 0) if it is new.
@@ -148,6 +241,7 @@ class FlatHistogram
   }
 
   std::deque<ColorInfo> &entries() { return itsEntries; }
+  std::size_t size() const { return itsEntries.size(); }
 
  private:
   struct Slot
@@ -185,10 +279,10 @@ class FlatHistogram
  */
 // ----------------------------------------------------------------------
 
-inline Color get_color(unsigned char *data, int i, int j, int stride)
+inline Color get_color(const unsigned char *data, int i, int j, int stride)
 {
-  unsigned char *ptr = data + j * stride + sizeof(Color) * i;
-  return *reinterpret_cast<Color *>(ptr);
+  const unsigned char *ptr = data + j * stride + sizeof(Color) * i;
+  return *reinterpret_cast<const Color *>(ptr);
 }
 
 // ----------------------------------------------------------------------
@@ -203,16 +297,164 @@ inline void set_color(unsigned char *data, int i, int j, int stride, Color color
   *reinterpret_cast<Color *>(ptr) = color;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count the colors in rows [row1,row2) of the image
+ *
+ * Solid 3x3 blocks are detected by looking at the two rows below the
+ * current row, which may belong to the next band. The data is only read,
+ * so bands can be scanned concurrently, and the keeper flags come out the
+ * same as when the full image is scanned at once.
+ *
+ * If truecolor is not null, the scan stops as soon as the colors seen so far
+ * guarantee that the image will be written in true color, or when another
+ * band has already set the flag.
+ */
+// ----------------------------------------------------------------------
+
+void count_colors(const unsigned char *data,
+                  int width,
+                  int height,
+                  int stride,
+                  int row1,
+                  int row2,
+                  FlatHistogram &counter,
+                  std::atomic<bool> *truecolor)
+{
+  // Insert the first color so we can prime the last1/last2 pointer cache. The
+  // count starts at 0; the first loop iteration increments it.
+
+  Color color0 = get_color(data, 0, row1, stride);
+  ColorInfo *last1 = counter.get(color0);
+  ColorInfo *last2 = last1;
+
+  AlphaStats alphas;
+  alphas.add(color0);
+
+  // Length of the current horizontal run of identical colors. A solid 3x3
+  // block requires at least three identical pixels in a row, so the block
+  // test below is skipped until the run reaches three. The block is anchored
+  // at its top edge (the current run) and verified against the next two rows,
+  // so a color in a solid region becomes a keeper at the first opportunity and
+  // the rest of the region short-circuits on the keeper flag.
+  int run = 0;
+
+  for (int j = row1; j < row2; j++)
+  {
+    if (truecolor != nullptr && truecolor->load(std::memory_order_relaxed))
+      return;
+
+    const auto *row = reinterpret_cast<const Color *>(data + static_cast<std::size_t>(j) * stride);
+
+    int i = 0;
+    while (i < width)
+    {
+      Color color = row[i];
+
+      if (last1->color == color)
+      {
+        // Count the whole run of identical pixels at once. A match across a row
+        // boundary does not continue a horizontal run.
+        const int previous = (i == 0 ? 0 : run);
+        int n = 1;
+        while (n < short_run && i + n < width && row[i + n] == color)
+          ++n;
+        if (n == short_run)
+          n += static_cast<int>(Simd::color_run(row + i + n, width - i - n, color));
+        last1->count += n;
+        run = previous + n;
+
+        // Once three colors line up horizontally, test whether they are the top
+        // edge of a solid 3x3 box. The run covers row j, so only the next two
+        // rows remain to be checked. Triples ending before column i were
+        // already tested, hence we start at most two columns before it.
+        if (run >= 3 && !last1->keeper && j + 2 < height)
+        {
+          const int start = i - std::min(previous, 2);
+          const auto *below1 = reinterpret_cast<const Color *>(
+              data + static_cast<std::size_t>(j + 1) * stride + sizeof(Color) * start);
+          const auto *below2 = reinterpret_cast<const Color *>(
+              data + static_cast<std::size_t>(j + 2) * stride + sizeof(Color) * start);
+          if (Simd::has_solid_triple(below1, below2, i + n - start, color))
+            last1->keep();
+        }
+
+        i += n;
+      }
+      else if (last2->color == color)
+      {
+        ++(*last2);
+        std::swap(last1, last2);
+        run = 1;
+        ++i;
+      }
+      else
+      {
+        // get() may grow the table, but only the inline slot array is
+        // reallocated; the ColorInfo records (and hence last1/last2) live in a
+        // deque and keep their addresses.
+        const std::size_t oldsize = counter.size();
+        ColorInfo *p = counter.get(color);
+        last2 = last1;
+        last1 = p;
+        ++(*last1);
+        run = 1;
+        ++i;
+
+        if (truecolor != nullptr && counter.size() > oldsize)
+        {
+          alphas.add(color);
+          if (counter.size() >= max_palette_size && alphas.manyAlphas())
+          {
+            truecolor->store(true, std::memory_order_relaxed);
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Histogram tables of the row bands, kept for reuse
+using HistogramCounters = std::vector<std::unique_ptr<FlatHistogram>>;
+
+// Return an empty table for a band, reusing the one of an earlier image if there is one
+FlatHistogram &band_counter(HistogramCounters &counters, int band, std::size_t expected)
+{
+  auto &counter = counters[band];
+  if (counter)
+    counter->reset(expected);
+  else
+    counter = std::make_unique<FlatHistogram>(expected);
+  return *counter;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Calculate the occurrance count of each color in the given image
  *
+ * Large images may be split into row bands which are counted in parallel.
+ * The band histograms are merged in band order, which reproduces the
+ * first-occurrence order of the serial scan. Hence the result is identical
+ * regardless of the number of threads.
+ *
+ * If truecolor is not null, the scan is abandoned as soon as it is certain
+ * that the image will be written in true color. *truecolor is then set and
+ * an empty histogram is returned.
+ *
  * \param image The image
- * \return The colormap with occurrance counts
+ * \param threads The number of threads to use, <= 0 for all hardware threads
+ * \param truecolor Optional output flag for an abandoned scan
+ * \param counters The band tables, reused if already allocated
+ * \param histogram The colormap with occurrance counts
  */
 // ----------------------------------------------------------------------
 
-ColorHistogram calc_histogram(cairo_surface_t *image)
+void calc_histogram(cairo_surface_t *image,
+                    int threads,
+                    bool *truecolor,
+                    HistogramCounters &counters,
+                    ColorHistogram &histogram)
 {
   try
   {
@@ -236,82 +478,66 @@ ColorHistogram calc_histogram(cairo_surface_t *image)
 
     // Not sure if this is even valid in Cairo, check anyway
 
+    histogram.clear();
     if (pixels == 0)
-      return {};
+      return;
+
+    const int bands = band_count(width, height, worker_count(threads), min_band_pixels);
 
     // Size the table for an upper bound of the number of distinct colors so it
     // rarely has to grow. The pixel count is the hard upper bound; we cap it
     // because images with more colors than this go to true color anyway, where
     // per-pixel probing (not table growth) dominates.
 
-    FlatHistogram counter(std::min<std::size_t>(pixels, std::size_t{1} << 16));
+    std::atomic<bool> abandoned{false};
+    std::atomic<bool> *stop = (truecolor != nullptr ? &abandoned : nullptr);
 
-    // Insert the first color so we can prime the last1/last2 pointer cache. The
-    // count starts at 0; the first loop iteration increments it.
+    if (counters.size() < static_cast<std::size_t>(bands))
+      counters.resize(bands);
 
-    Color color0 = get_color(data, 0, 0, stride);
-    ColorInfo *last1 = counter.get(color0);
-    ColorInfo *last2 = last1;
+    if (bands == 1)
+    {
+      FlatHistogram &counter =
+          band_counter(counters, 0, std::min<std::size_t>(pixels, max_expected_colors));
+      count_colors(data, width, height, stride, 0, height, counter, stop);
+      if (abandoned)
+      {
+        *truecolor = true;
+        return;
+      }
+      histogram.assign(counter.entries().begin(), counter.entries().end());
+      return;
+    }
 
-    // Length of the current horizontal run of identical colors. A solid 3x3
-    // block requires at least three identical pixels in a row, so the block
-    // test below is skipped until the run reaches three. The block is anchored
-    // at its top edge (the current run) and verified against the next two rows,
-    // so a color in a solid region becomes a keeper at the first opportunity and
-    // the rest of the region short-circuits on the keeper flag.
-    int run = 0;
+    parallel_bands(height,
+                   bands,
+                   [&](int band, int row1, int row2)
+                   {
+                     const auto band_pixels = static_cast<std::size_t>(width) * (row2 - row1);
+                     FlatHistogram &counter = band_counter(
+                         counters, band, std::min<std::size_t>(band_pixels, max_expected_colors));
+                     count_colors(data, width, height, stride, row1, row2, counter, stop);
+                   });
 
-    for (int j = 0; j < height; j++)
-      for (int i = 0; i < width; i++)
-      {
-        Color color = get_color(data, i, j, stride);
+    // The flag set by any band is a sufficient condition for the whole image
 
-        if (last1->color == color)
-        {
-          ++(*last1);
-          // A match across a row boundary does not continue a horizontal run
-          run = (i == 0 ? 1 : run + 1);
-
-          // Once three colors line up horizontally (run >= 3 implies i >= 2),
-          // test whether they are the top edge of a solid 3x3 box. The current
-          // run covers row j at columns i-2..i, so only the next two rows remain
-          // to be checked.
-          if (run >= 3 && !last1->keeper && j + 2 < height)
-          {
-            // Test the farther row (j+2) first: it is less spatially correlated
-            // with the matched run on row j, so it is the likeliest to differ and
-            // short-circuit the && chain (e.g. for a band exactly two rows tall).
-            if (get_color(data, i - 2, j + 2, stride) == color &&
-                get_color(data, i - 1, j + 2, stride) == color &&
-                get_color(data, i, j + 2, stride) == color &&
-                get_color(data, i - 2, j + 1, stride) == color &&
-                get_color(data, i - 1, j + 1, stride) == color &&
-                get_color(data, i, j + 1, stride) == color)
-            {
-              last1->keep();
-            }
-          }
-        }
-        else if (last2->color == color)
-        {
-          ++(*last2);
-          std::swap(last1, last2);
-          run = 1;
-        }
-        else
-        {
-          // get() may grow the table, but only the inline slot array is
-          // reallocated; the ColorInfo records (and hence last1/last2) live in a
-          // deque and keep their addresses.
-          ColorInfo *p = counter.get(color);
-          last2 = last1;
-          last1 = p;
-          ++(*last1);
-          run = 1;
-        }
-      }
+    if (abandoned)
+    {
+      *truecolor = true;
+      return;
+    }
+
+    // Merge in band order. A color first seen in band k is appended when band k
+    // is merged, at its position within that band, just as in a serial scan.
+
+    FlatHistogram &counter = *counters[0];
+    for (int band = 1; band < bands; band++)
+    {
+      for (const auto &info : counters[band]->entries())
+        counter.get(info.color)->merge(info);
+    }
 
-    return ColorHistogram(counter.entries().begin(), counter.entries().end());
+    histogram.assign(counter.entries().begin(), counter.entries().end());
   }
   catch (...)
   {
@@ -319,13 +545,54 @@ ColorHistogram calc_histogram(cairo_surface_t *image)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether all pixels are opaque and whether all are gray
+ */
+// ----------------------------------------------------------------------
+
+void opaque_gray(cairo_surface_t *image, bool &opaque, bool &gray)
+{
+  try
+  {
+    cairo_surface_flush(image);
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);  // bytes to next row
+    const unsigned char *data = cairo_image_surface_get_data(image);
+
+    for (int j = 0; j < height && (opaque || gray); j++)
+      Simd::opaque_gray(reinterpret_cast<const Color *>(data + j * stride), width, opaque, gray);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Test whether all colors are opaque and whether all are gray
+void opaque_gray(Color color, bool &opaque, bool &gray)
+{
+  opaque = opaque && (alpha(color) == 255);
+  gray = gray && (red(color) == green(color) && green(color) == blue(color));
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Perform color replacement
+ *
+ * If indices is not null, it receives the palette index of each pixel
+ * row by row without padding.
+ *
+ * Large images are processed in parallel row bands. The rows are mapped
+ * independently, each with its own cache of the last colors seen.
  */
 // ----------------------------------------------------------------------
 
-void replace_colors(cairo_surface_t *image, const Giza::ColorMap &colormap)
+void replace_colors(cairo_surface_t *image,
+                    const DenseColorMap &colormap,
+                    std::vector<uint8_t> *indices,
+                    int threads)
 {
   try
   {
@@ -345,40 +612,29 @@ void replace_colors(cairo_surface_t *image, const Giza::ColorMap &colormap)
     int stride = cairo_image_surface_get_stride(image);  // bytes to next row
     unsigned char *data = cairo_image_surface_get_data(image);
 
-    // colormap is an unordered_map keyed on the color, so the per-pixel lookups
-    // below are already O(1). Every color in the image is a key in it (the map
-    // is built from the full histogram), so at() always succeeds.
+    if (indices != nullptr)
+      indices->resize(static_cast<std::size_t>(width) * height);
 
-    // Remember last color conversions for extra speed
-
-    Color last_color1 = 0;
-    Color last_choice1 = 0;
-    Color last_color2 = 0;
-    Color last_choice2 = 0;
-
-    for (int j = 0; j < height; j++)
+    auto replace_rows = [&](int row1, int row2)
     {
-      for (int i = 0; i < width; i++)
+      uint8_t *index = nullptr;
+      for (int j = row1; j < row2; j++)
       {
-        Color color = get_color(data, i, j, stride);
-        if (color == last_color1)
-          set_color(data, i, j, stride, last_choice1);
-        else if (color == last_color2)
-        {
-          set_color(data, i, j, stride, last_choice2);
-          std::swap(last_color1, last_color2);
-          std::swap(last_choice1, last_choice2);
-        }
-        else
-        {
-          last_color2 = last_color1;
-          last_choice2 = last_choice1;
-          last_color1 = color;
-          last_choice1 = colormap.at(color);
-          set_color(data, i, j, stride, last_choice1);
-        }
+        auto *row = reinterpret_cast<Color *>(data + static_cast<std::size_t>(j) * stride);
+        if (indices != nullptr)
+          index = indices->data() + static_cast<std::size_t>(j) * width;
+        colormap.map(row, width, row, index);
       }
-    }
+    };
+
+    const int bands = band_count(width, height, worker_count(threads), min_band_pixels);
+
+    if (bands == 1)
+      replace_rows(0, height);
+    else
+      parallel_bands(height,
+                     bands,
+                     [&](int /* band */, int row1, int row2) { replace_rows(row1, row2); });
   }
   catch (...)
   {
@@ -507,6 +763,279 @@ void build_tree(cairo_surface_t *image,
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a color map built with the given options may be reused
+ */
+// ----------------------------------------------------------------------
+
+bool same_reduction(const ColorMapOptions &options1, const ColorMapOptions &options2)
+{
+  return (options1.quality == options2.quality && options1.errorfactor == options2.errorfactor &&
+          options1.maxcolors == options2.maxcolors &&
+          options1.estimatequality == options2.estimatequality &&
+          options1.twophase == options2.twophase);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fraction of the pixels whose colors are in the color map
+ */
+// ----------------------------------------------------------------------
+
+double coverage(const ColorHistogram &hist, const ColorMap &colormap)
+{
+  try
+  {
+    std::size_t total = 0;
+    std::size_t known = 0;
+    for (const auto &info : hist)
+    {
+      total += info.count;
+      if (colormap.find(info.color) != colormap.end())
+        known += info.count;
+    }
+    return (total == 0 ? 0.0 : static_cast<double>(known) / total);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extend the color tree and the colormap of a previous image
+ *
+ * Only the colors missing from the colormap are processed, in histogram
+ * order as in build_tree. Once the tree has maxcolors colors the remaining
+ * colors are merged into their nearest colors, except for the keepers.
+ */
+// ----------------------------------------------------------------------
+
+void extend_tree(cairo_surface_t *image,
+                 const ColorHistogram &hist,
+                 ColorTree &colortree,
+                 ColorMap &colormap,
+                 double quality,
+                 int maxcolors)
+{
+  try
+  {
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+
+    const double ratio = 1.0 / (width * height);
+    const double factor = -quality / log(10.0);
+
+    for (const auto &info : hist)
+    {
+      if (colormap.find(info.color) != colormap.end())
+        continue;
+
+      if (colortree.empty() || info.keeper)
+      {
+        colortree.insert(info.color);
+        colormap[info.color] = info.color;
+      }
+      else
+      {
+        double dist = 0;
+        Color nearest = colortree.nearest(info.color, dist);
+
+        const double limit = factor * log(ratio * info.count);
+        if (dist < limit || (maxcolors > 0 && colortree.size() >= maxcolors))
+          colormap[info.color] = nearest;
+        else
+        {
+          colortree.insert(info.color);
+          colormap[info.color] = info.color;
+        }
+      }
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the merged colors to their nearest colors in the final palette
+ *
+ * During the tree build a merged color is mapped to the nearest color
+ * available at that moment. Colors inserted later may be nearer, so
+ * the second phase of the two-phase mode searches the complete tree.
+ * The tree is not modified, so the searches can be made in parallel.
+ */
+// ----------------------------------------------------------------------
+
+void remap_colors(const ColorTree &colortree, ColorMap &colormap, int threads)
+{
+  try
+  {
+    std::vector<Color> colors;
+    for (const auto &item : colormap)
+      if (item.first != item.second)
+        colors.push_back(item.first);
+
+    const int n = static_cast<int>(colors.size());
+    std::vector<Color> nearest(colors.size());
+    std::vector<double> distances(colors.size());
+
+    const int bands = band_count(1, n, worker_count(threads), min_remap_colors);
+
+    parallel_bands(n,
+                   bands,
+                   [&](int /* band */, int first, int last)
+                   {
+                     colortree.nearest(colors.data() + first,
+                                       last - first,
+                                       nearest.data() + first,
+                                       distances.data() + first);
+                   });
+
+    for (std::size_t i = 0; i < colors.size(); i++)
+      colormap[colors[i]] = nearest[i];
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Largest critical qualities found during a pass, the smallest one on top
+using CriticalQualities = std::priority_queue<double, std::vector<double>, std::greater<double>>;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief One pass of the estimated maxcolors search
+ *
+ * The critical quality of a color is the quality above which the color
+ * would have been merged into the tree instead of being inserted.
+ *
+ * Until the palette overflows the pass is the same as a pass of the
+ * iterative search. After that colors are merged into their nearest color,
+ * except that if the critical qualities are requested, colors are inserted
+ * as if the quality were the smallest one which would keep the palette
+ * within the limit. Their critical qualities then estimate that quality.
+ *
+ * \return True if the palette overflowed
+ */
+// ----------------------------------------------------------------------
+
+bool estimate_pass(const ColorHistogram &hist,
+                   ColorTree &colortree,
+                   ColorMap &colormap,
+                   double quality,
+                   double ratio,
+                   int maxcolors,
+                   CriticalQualities *critical)
+{
+  try
+  {
+    const double factor = -quality / log(10.0);
+
+    bool overflow = false;
+    bool optional = false;
+    std::size_t allowed = 0;  // number of optional colors which fit
+
+    for (const auto &info : hist)
+    {
+      if (colortree.empty() || info.keeper)
+      {
+        colortree.insert(info.color);
+        colormap[info.color] = info.color;
+        continue;
+      }
+
+      // The mandatory colors are first in the histogram
+      if (!optional)
+      {
+        optional = true;
+        allowed = std::max(0, maxcolors - colortree.size());
+      }
+
+      double dist = 0;
+      Color nearest = colortree.nearest(info.color, dist);
+
+      const double limit = factor * log(ratio * info.count);
+      const double critical_quality = dist / limit * quality;
+
+      bool merge = (dist < limit);
+      if (!merge && colortree.size() >= maxcolors)
+      {
+        overflow = true;
+        merge = (critical == nullptr ||
+                 (critical->size() > allowed && critical_quality <= critical->top()));
+      }
+
+      if (merge)
+        colormap[info.color] = nearest;
+      else
+      {
+        if (critical != nullptr)
+        {
+          if (critical->size() > allowed)
+            critical->pop();
+          critical->push(critical_quality);
+        }
+        colortree.insert(info.color);
+        colormap[info.color] = info.color;
+      }
+    }
+    return overflow;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build a color tree and a colormap with at most two passes
+ *
+ * The first pass estimates the smallest quality which keeps the palette
+ * within maxcolors, and the second pass uses it. Should the estimate be too
+ * small, the remaining colors are merged into their nearest colors.
+ */
+// ----------------------------------------------------------------------
+
+void build_tree_estimated(cairo_surface_t *image,
+                          const ColorHistogram &hist,
+                          ColorTree &colortree,
+                          ColorMap &colormap,
+                          double quality,
+                          int maxcolors)
+{
+  try
+  {
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+
+    const double ratio = 1.0 / (width * height);
+
+    colormap.reserve(hist.size());
+
+    CriticalQualities critical;
+    if (!estimate_pass(hist, colortree, colormap, quality, ratio, maxcolors, &critical))
+      return;
+
+    // Merge also the color with the critical quality on top
+    quality = std::nextafter(critical.top(), std::numeric_limits<double>::max());
+
+    colortree.clear();
+    colormap.clear();
+    estimate_pass(hist, colortree, colormap, quality, ratio, maxcolors, nullptr);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
 // Histogram order: keepers first, then by descending occurrence count. Kept as
 // a small inlinable functor (no function-pointer indirection, no try/catch) so
 // the compiler can inline it into the sort's inner loop. The comparison is pure
@@ -521,24 +1050,123 @@ struct ColorCmp
   }
 };
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sort a histogram into ColorCmp order with an LSD radix sort
+ *
+ * Each color is packed into a 64-bit item with the sort key in the upper
+ * half. The key is the keeper flag (inverted so that keepers come first)
+ * above the distance of the count from the maximum count, which orders
+ * counts in descending order using only as many bits as the counts need.
+ * The key is sorted in at most three counting passes of at most 11 bits,
+ * all of whose bucket counts are gathered in a single pass. Each pass is
+ * stable, so ties keep their first-occurrence order.
+ */
+// ----------------------------------------------------------------------
+
+void radix_sort(ColorHistogram &hist)
+{
+  const std::size_t n = hist.size();
+  if (n < 2)
+    return;
+
+  Count maxcount = 0;
+  for (const auto &info : hist)
+    maxcount = std::max(maxcount, info.count);
+
+  // Key width: bits needed for the count distance plus the keeper bit. A
+  // count is at most the number of pixels, so the key fits in 32 bits.
+  unsigned int countbits = 0;
+  while (countbits < 31 && (maxcount >> countbits) != 0)
+    ++countbits;
+  const unsigned int keybits = countbits + 1;
+
+  const unsigned int passes = (keybits + 10) / 11;
+  const unsigned int digitbits = (keybits + passes - 1) / passes;
+  const std::size_t buckets = std::size_t{1} << digitbits;
+  const uint64_t digitmask = buckets - 1;
+
+  std::vector<uint64_t> items(n);
+  std::vector<uint64_t> buffer(n);
+  std::vector<std::size_t> offsets(passes * buckets, 0);
+
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const auto &info = hist[i];
+    const uint64_t key =
+        (static_cast<uint64_t>(info.keeper ? 0 : 1) << countbits) | (maxcount - info.count);
+    items[i] = (key << 32) | info.color;
+    for (unsigned int pass = 0; pass < passes; pass++)
+      ++offsets[pass * buckets + ((key >> (pass * digitbits)) & digitmask)];
+  }
+
+  for (unsigned int pass = 0; pass < passes; pass++)
+  {
+    const unsigned int shift = 32 + pass * digitbits;
+    std::size_t *offset = &offsets[pass * buckets];
+
+    // A pass where all the items have the same digit would not change the order
+    if (offset[(items[0] >> shift) & digitmask] == n)
+      continue;
+
+    std::size_t sum = 0;
+    for (std::size_t b = 0; b < buckets; b++)
+    {
+      const std::size_t count = offset[b];
+      offset[b] = sum;
+      sum += count;
+    }
+
+    for (const auto item : items)
+      buffer[offset[(item >> shift) & digitmask]++] = item;
+
+    items.swap(buffer);
+  }
+
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const uint64_t key = items[i] >> 32;
+    auto &info = hist[i];
+    info.color = static_cast<Color>(items[i]);
+    info.count = maxcount - static_cast<Count>(key & ((uint64_t{1} << countbits) - 1));
+    info.keeper = ((key >> countbits) == 0);
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Calculate the histogram for color reduction
  *
+ * The histogram is not sorted if the scan was abandoned for true color.
+ *
  * \param image The image
- * \return The histogram object
+ * \param threads The number of threads to use for the histogram
+ * \param truecolor Optional output flag for an abandoned scan
+ * \param counters The band tables, reused if already allocated
+ * \param histogram The histogram object
  */
 // ----------------------------------------------------------------------
 
-ColorHistogram colorhistogram(cairo_surface_t *image)
+void colorhistogram(cairo_surface_t *image,
+                    int threads,
+                    bool *truecolor,
+                    HistogramCounters &counters,
+                    ColorHistogram &histogram)
 {
   try
   {
-    ColorHistogram histogram = calc_histogram(image);
+    calc_histogram(image, threads, truecolor, counters, histogram);
+    if (truecolor != nullptr && *truecolor)
+      return;
 
-    std::sort(histogram.begin(), histogram.end(), ColorCmp());
+    // The radix sort is linear but has a fixed cost of clearing and scanning
+    // up to 2048 buckets per pass, so comparison sorting wins for histograms
+    // with fewer colors than that.
 
-    return histogram;
+    if (histogram.size() < min_radix_sort_size)
+      std::sort(histogram.begin(), histogram.end(), ColorCmp());
+    else
+      radix_sort(histogram);
   }
   catch (...)
   {
@@ -552,18 +1180,21 @@ ColorHistogram colorhistogram(cairo_surface_t *image)
  *
  * The use count of a reduced (target) color is the sum of the histogram
  * counts of all the original colors that map to it. Ties are broken by
- * ascending color value so the result is fully deterministic. The returned
+ * ascending color value so the result is fully deterministic. The palette
  * order is used directly as the palette index order, so the most used color
  * becomes index 0.
  */
 // ----------------------------------------------------------------------
 
-std::vector<Color> ordered_palette(const ColorHistogram &hist,
-                                   const ColorMap &colormap,
-                                   std::size_t maxcolors)
+void ordered_palette(const ColorHistogram &hist,
+                     const ColorMap &colormap,
+                     std::size_t maxcolors,
+                     std::vector<Color> &palette)
 {
   try
   {
+    palette.clear();
+
     std::unordered_map<Color, Count> usecount;
     usecount.reserve(colormap.size());
     for (const auto &info : hist)
@@ -572,9 +1203,8 @@ std::vector<Color> ordered_palette(const ColorHistogram &hist,
     // More than maxcolors distinct colors means the image will be encoded in
     // true color, so no palette is needed and we skip the (wasted) ordering.
     if (usecount.size() > maxcolors)
-      return {};
+      return;
 
-    std::vector<Color> palette;
     palette.reserve(usecount.size());
     for (const auto &value : usecount)
       palette.push_back(value.first);
@@ -589,8 +1219,52 @@ std::vector<Color> ordered_palette(const ColorHistogram &hist,
                   return ca > cb;
                 return a < b;
               });
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the colors of the image missing from the colormap
+ *
+ * Runs of the same color are skipped, and the colors are returned sorted
+ * without duplicates.
+ */
+// ----------------------------------------------------------------------
+
+void missing_colors(cairo_surface_t *image, const ColorMap &colormap, std::vector<Color> &colors)
+{
+  try
+  {
+    colors.clear();
+
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      throw Fmi::Exception(BCP, "Color replacement is implemented only for ARGB32 images");
+
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    const unsigned char *data = cairo_image_surface_get_data(image);
+
+    for (int j = 0; j < height; j++)
+    {
+      const auto *row =
+          reinterpret_cast<const Color *>(data + static_cast<std::size_t>(j) * stride);
+      std::size_t i = 0;
+      while (i < static_cast<std::size_t>(width))
+      {
+        const Color color = row[i];
+        if (colormap.find(color) == colormap.end())
+          colors.push_back(color);
+        i += Simd::color_run(row + i, width - i, color);
+      }
+    }
 
-    return palette;
+    std::sort(colors.begin(), colors.end());
+    colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
   }
   catch (...)
   {
@@ -600,6 +1274,25 @@ std::vector<Color> ordered_palette(const ColorHistogram &hist,
 
 }  // namespace
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Buffers whose capacity is reused from one image to the next
+ */
+// ----------------------------------------------------------------------
+
+struct ColorMapper::Workspace
+{
+  HistogramCounters counters;
+  ColorHistogram histogram;
+  ColorTree tree;
+  std::vector<Color> missing;  // colors missing from a fixed palette colormap
+  std::vector<Color> nearest;  // and their nearest palette colors
+};
+
+ColorMapper::ColorMapper() : itsWorkspace(std::make_unique<Workspace>()) {}
+
+ColorMapper::~ColorMapper() = default;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set colormapper options
@@ -631,7 +1324,10 @@ void ColorMapper::options(const ColorMapOptions &theOptions)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return true of true color mode is forced
+ * \brief Return true if the last analyzed image is in true color
+ *
+ * True color may be forced by the options, or chosen by analyze() if the
+ * image has too many colors or alpha values for a palette.
  */
 // ----------------------------------------------------------------------
 
@@ -639,7 +1335,7 @@ bool ColorMapper::trueColor() const
 {
   try
   {
-    return itsOptions.truecolor;
+    return itsTrueColor;
   }
   catch (...)
   {
@@ -699,7 +1395,9 @@ Histogram ColorMapper::histogram(cairo_surface_t *image)
     if (image == nullptr)
       throw Fmi::Exception(BCP, "Cannot calculate colour histogram for a null pointer");
 
-    ColorHistogram hist = calc_histogram(image);
+    HistogramCounters counters;
+    ColorHistogram hist;
+    calc_histogram(image, 1, nullptr, counters, hist);
 
     Histogram h;
 
@@ -714,6 +1412,92 @@ Histogram ColorMapper::histogram(cairo_surface_t *image)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Apply the latest color map to pixels
+ *
+ * The pixels are copied unchanged if the image needed no color map.
+ * The output may be the same array as the input.
+ */
+// ----------------------------------------------------------------------
+
+void ColorMapper::mapColors(const Color *pixels, std::size_t n, Color *colors) const
+{
+  try
+  {
+    if (itsDenseMap.empty() || itsIdentityMap)
+    {
+      if (colors != pixels)
+        std::copy(pixels, pixels + n, colors);
+    }
+    else
+      itsDenseMap.map(pixels, n, colors, nullptr);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Palette indices of pixels according to the latest color map
+ */
+// ----------------------------------------------------------------------
+
+void ColorMapper::mapIndices(const Color *pixels, std::size_t n, uint8_t *indices) const
+{
+  try
+  {
+    if (itsPalette.empty())
+      throw Fmi::Exception(BCP, "Palette indices are not available for true color images");
+    itsDenseMap.map(pixels, n, nullptr, indices);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Request palette indices from subsequent reductions
+ */
+// ----------------------------------------------------------------------
+
+void ColorMapper::indices(bool enable)
+{
+  try
+  {
+    itsMakeIndices = enable;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the palette indices of the pixels
+ *
+ * The indices are stored row by row without padding. They are available
+ * only if requested before reduce() and the image is not in true color.
+ */
+// ----------------------------------------------------------------------
+
+const std::vector<uint8_t> &ColorMapper::indices() const
+{
+  try
+  {
+    return itsIndices;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Reduce colors from the image adaptively
@@ -764,6 +1548,23 @@ Histogram ColorMapper::histogram(cairo_surface_t *image)
  * colours will be converted to the colours that must be kept, and the
  * process stops.
  *
+ * Alternatively, if estimatequality is set, the first pass records for
+ * each colour the quality at which it would have been merged instead of
+ * being kept, and the second pass uses the smallest quality which should
+ * keep the number of colours within the limit. Any colours which still do
+ * not fit are converted to their nearest colours. This bounds the work to
+ * two passes and typically uses the full colour budget.
+ *
+ * If reusecoverage is set and the colours already in the colour map of the
+ * previous image cover enough of the pixels, the tree and the colour map
+ * are not rebuilt. Only the new colours are added to them, which makes
+ * reducing consecutive frames of an animation or a time series much
+ * faster.
+ *
+ * If a fixed palette is given, the colours are simply replaced by their
+ * nearest palette colours, which are looked up only for colours not seen
+ * in the previous images.
+ *
  * \param image The image to modify
  */
 // ----------------------------------------------------------------------
@@ -772,52 +1573,113 @@ void ColorMapper::reduce(cairo_surface_t *image)
 {
   try
   {
-    itsPalette.clear();
+    itsIndices.clear();
+
+    analyze(image);
+    if (itsDenseMap.empty())
+      return;
+
+    // An identity mapping needs to be applied only to obtain the indices
+    const bool indexed = (itsMakeIndices && !itsPalette.empty());
+    if (itsIdentityMap && !indexed)
+      return;
+
+    replace_colors(image, itsDenseMap, indexed ? &itsIndices : nullptr, itsOptions.threads);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the color map without modifying the image
+ *
+ * The color map can then be applied on the fly with mapColors() and
+ * mapIndices(), for example while encoding the image.
+ */
+// ----------------------------------------------------------------------
 
-    // Skip histogram etc if true color is forced
-    if (itsOptions.truecolor)
+void ColorMapper::analyze(cairo_surface_t *image)
+{
+  try
+  {
+    itsTrueColor = itsOptions.truecolor;
+
+    if (itsOptions.palette && !itsTrueColor)
+    {
+      analyze_fixed(image);
       return;
+    }
+
+    itsFixedPalette.reset();
+    itsPalette.clear();
+    itsDenseMap.clear();
+    itsIdentityMap = false;
+    itsOpaque = false;
+    itsGray = false;
+
+    // Skip histogram etc if true color is forced. The image is scanned only
+    // to find out whether it could be written without colors or alpha.
+    if (itsTrueColor)
+    {
+      itsOpaque = true;
+      itsGray = true;
+      opaque_gray(image, itsOpaque, itsGray);
+      return;
+    }
 
     // Calculate the histogram
 
-    ColorHistogram hist = colorhistogram(image);
+    // The histogram scan stops early if the image is certain to need RGBA
+    // according to the alpha test below, and the sorting is then skipped too.
+
+    bool truecolor = false;
+    ColorHistogram &hist = itsWorkspace->histogram;
+    colorhistogram(image, itsOptions.threads, &truecolor, itsWorkspace->counters, hist);
+    if (truecolor)
+    {
+      // The scan stopped at many alpha values, so only grayness is unknown
+      itsTrueColor = true;
+      itsGray = true;
+      opaque_gray(image, itsOpaque, itsGray);
+      return;
+    }
 
     // Abort if we should use RGBA:
     // - there are many different alpha values
     // - smallest alpha is below some limit
 
-    const int max_unique_alphas = 100;
-    const unsigned char max_min_alpha = 128;
-
-    unsigned char min_alpha = 255;
-    std::vector<int> alphas(256, 0);
+    AlphaStats alphas;
     for (const auto &c : hist)
-    {
-      auto a = alpha(c.color);
-      alphas[a] = 1;
-      min_alpha = std::min(min_alpha, a);
-    }
-    int num_alphas = std::count(alphas.begin(), alphas.end(), 1);
+      alphas.add(c.color);
 
-    if (num_alphas > max_unique_alphas || (min_alpha < max_min_alpha))
+    if (alphas.manyAlphas())
     {
-      if (hist.size() >= 256)
+      if (hist.size() >= max_palette_size)
       {
-        itsOptions.truecolor = true;
+        itsTrueColor = true;
+        itsOpaque = true;
+        itsGray = true;
+        for (const auto &c : hist)
+          opaque_gray(c.color, itsOpaque, itsGray);
         return;
       }
       // Now we want palette mode but no color reductions
 
-      itsOptions.truecolor = false;
-
       // Identify mapping
+      itsReusable = false;
       itsColorMap.clear();
       itsColorMap.reserve(hist.size());
       for (const auto &c : hist)
         itsColorMap.insert(ColorMap::value_type(c.color, c.color));
 
       // hist.size() < 256 here, so the palette never exceeds the limit
-      itsPalette = ordered_palette(hist, itsColorMap, 256);
+      ordered_palette(hist, itsColorMap, 256, itsPalette);
+
+      itsDenseMap.assign(itsColorMap, itsPalette);
+      itsIdentityMap = true;
 
       return;
     }
@@ -825,27 +1687,108 @@ void ColorMapper::reduce(cairo_surface_t *image)
     // Select the colors and perform the replacements. Subsequent operations
     // will use the ColorMap to produce the palette.
 
-    ColorTree tree;
-    itsColorMap.clear();
+    ColorTree &tree = itsWorkspace->tree;
 
-    if (itsOptions.maxcolors <= 0)
-      build_tree(image, hist, tree, itsColorMap, itsOptions.quality);
+    const bool reuse = (itsReusable && itsOptions.reusecoverage > 0 &&
+                        same_reduction(itsOptions, itsReuseOptions) &&
+                        itsColorMap.size() < max_reused_colors &&
+                        coverage(hist, itsColorMap) >= itsOptions.reusecoverage);
+
+    if (reuse)
+      extend_tree(image, hist, tree, itsColorMap, itsOptions.quality, itsOptions.maxcolors);
     else
-      build_tree(image,
-                 hist,
-                 tree,
-                 itsColorMap,
-                 itsOptions.quality,
-                 itsOptions.maxcolors,
-                 itsOptions.errorfactor);
+    {
+      tree.reset();
+      itsColorMap.clear();
+
+      if (itsOptions.maxcolors <= 0)
+        build_tree(image, hist, tree, itsColorMap, itsOptions.quality);
+      else if (itsOptions.estimatequality)
+        build_tree_estimated(
+            image, hist, tree, itsColorMap, itsOptions.quality, itsOptions.maxcolors);
+      else
+        build_tree(image,
+                   hist,
+                   tree,
+                   itsColorMap,
+                   itsOptions.quality,
+                   itsOptions.maxcolors,
+                   itsOptions.errorfactor);
+
+      itsReusable = true;
+      itsReuseOptions = itsOptions;
+    }
+
+    if (itsOptions.twophase)
+      remap_colors(tree, itsColorMap, itsOptions.threads);
 
     // Order the palette only if it fits; otherwise the image is encoded in true
     // color and no palette is built.
-    itsPalette = ordered_palette(hist, itsColorMap, 256);
+    ordered_palette(hist, itsColorMap, 256, itsPalette);
     if (itsPalette.empty())
-      itsOptions.truecolor = true;
+    {
+      // The image consists of the replacement colors
+      itsTrueColor = true;
+      itsOpaque = true;
+      itsGray = true;
+      for (const auto &item : itsColorMap)
+        opaque_gray(item.second, itsOpaque, itsGray);
+    }
+
+    itsDenseMap.assign(itsColorMap, itsPalette);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the colors to a fixed palette
+ *
+ * The colormap is kept for subsequent images with the same palette, so
+ * that only colors not seen before need a palette search. In the steady
+ * state the image is only scanned for new colors, and the lookup table
+ * is rebuilt only if some were found.
+ */
+// ----------------------------------------------------------------------
+
+void ColorMapper::analyze_fixed(cairo_surface_t *image)
+{
+  try
+  {
+    // Forget the colors of other palettes and an excessive number of old colors
+    if (itsFixedPalette != itsOptions.palette || itsColorMap.size() > max_fixed_colors)
+    {
+      itsFixedPalette = itsOptions.palette;
+      itsColorMap.clear();
+      itsDenseMap.clear();
+
+      // As in the other modes the replacement colors map to themselves, so
+      // that a reduced image can be mapped again
+      for (const auto color : itsFixedPalette->colors())
+        itsColorMap[color] = color;
+    }
+
+    itsReusable = false;
+    itsIdentityMap = false;
+    itsOpaque = false;
+    itsGray = false;
+    itsPalette = itsFixedPalette->colors();
+
+    auto &missing = itsWorkspace->missing;
+    auto &nearest = itsWorkspace->nearest;
+    missing_colors(image, itsColorMap, missing);
+    if (missing.empty() && !itsDenseMap.empty())
+      return;
+
+    nearest.resize(missing.size());
+    itsFixedPalette->nearest(missing.data(), missing.size(), nearest.data());
+    for (std::size_t i = 0; i < missing.size(); i++)
+      itsColorMap[missing[i]] = nearest[i];
 
-    replace_colors(image, itsColorMap);
+    itsDenseMap.assign(itsColorMap, itsPalette);
   }
   catch (...)
   {
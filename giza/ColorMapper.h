@@ -2,8 +2,12 @@
 
 #include "ColorMapOptions.h"
 #include "ColorTypes.h"
+#include "DenseColorMap.h"
 #include <cairo/cairo.h>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <vector>
 
 namespace Giza
@@ -11,6 +15,11 @@ namespace Giza
 class ColorMapper
 {
  public:
+  ColorMapper();
+  ~ColorMapper();
+  ColorMapper(const ColorMapper& other) = delete;
+  ColorMapper& operator=(const ColorMapper& other) = delete;
+
   void options(const ColorMapOptions& theOptions);
 
   static Histogram histogram(cairo_surface_t* image);
@@ -20,12 +29,50 @@ class ColorMapper
   // used color is index 0. Empty in true color mode.
   const std::vector<Color>& palette() const;
   void reduce(cairo_surface_t* image);
+
+  // True if the last analyzed image is in true color, either because the
+  // options force it or because the image does not fit a palette
   bool trueColor() const;
 
+  // True if all colors of the reduced image are opaque, and if all are gray.
+  // Calculated in true color mode only, and false otherwise.
+  bool opaque() const { return itsOpaque; }
+  bool gray() const { return itsGray; }
+
+  // Calculate the color map and the palette without modifying the image, and
+  // apply them later on the fly to rows of pixels. The rows may also be ones
+  // already reduced by reduce(), since the reduced colors map to themselves.
+  void analyze(cairo_surface_t* image);
+  void mapColors(const Color* pixels, std::size_t n, Color* colors) const;
+  void mapIndices(const Color* pixels, std::size_t n, std::uint8_t* indices) const;
+
+  // Request an 8-bit palette index image from reduce(). The indices are stored
+  // row by row without padding, and are empty in true color mode.
+  void indices(bool enable);
+  const std::vector<std::uint8_t>& indices() const;
+
  private:
+  void analyze_fixed(cairo_surface_t* image);
+
   ColorMapOptions itsOptions;
   ColorMap itsColorMap;           // latest calculated color conversion map
   std::vector<Color> itsPalette;  // reduced colors ordered by descending use count
+  bool itsMakeIndices = false;
+  std::vector<std::uint8_t> itsIndices;  // palette indices of the pixels
+  DenseColorMap itsDenseMap;             // flat version of itsColorMap
+  bool itsIdentityMap = false;           // itsColorMap maps colors to themselves
+  bool itsTrueColor = false;             // the last image is in true color
+  bool itsOpaque = false;                // true color image is fully opaque
+  bool itsGray = false;                  // true color image is gray
+  bool itsReusable = false;              // itsColorMap may be extended for the next image
+  ColorMapOptions itsReuseOptions;       // options itsColorMap was built with
+
+  // The fixed palette itsColorMap maps the colors seen so far to
+  std::shared_ptr<const FixedPalette> itsFixedPalette;
+
+  // Scratch space kept for reducing further images with the same mapper
+  struct Workspace;
+  std::unique_ptr<Workspace> itsWorkspace;
 
 };  // class ColorMapper
 
@@ -0,0 +1,289 @@
+#include "ColorScan.h"
+#include "Simd.h"
+#include <macgyver/Exception.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef GIZA_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace Giza
+{
+namespace
+{
+// Vector width the component arrays are padded to (AVX-512 floats)
+constexpr std::size_t padding = 16;
+
+// Component value for padding entries, far from any real color but small
+// enough for the squared distance to remain finite
+constexpr float far_away = 1e9F;
+
+// The two smallest squared distances and the position of the smallest
+struct ScanResult
+{
+  float best = std::numeric_limits<float>::infinity();
+  float second = std::numeric_limits<float>::infinity();
+  std::size_t index = 0;
+
+  void add(float dist, std::size_t i)
+  {
+    if (dist < best)
+    {
+      second = best;
+      best = dist;
+      index = i;
+    }
+    else
+      second = std::min(second, dist);
+  }
+};
+
+// ----------------------------------------------------------------------
+/*
+ * Squared distance 3r^2 + 4g^2 + 2b^2 + a^2 to all the colors
+ */
+// ----------------------------------------------------------------------
+
+void scan_scalar(const float* r,
+                 const float* g,
+                 const float* b,
+                 const float* a,
+                 std::size_t n,
+                 const GammaColor& color,
+                 ScanResult& result)
+{
+  const auto qr = static_cast<float>(color.r);
+  const auto qg = static_cast<float>(color.g);
+  const auto qb = static_cast<float>(color.b);
+  const auto qa = static_cast<float>(color.a);
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const float dr = r[i] - qr;
+    const float dg = g[i] - qg;
+    const float db = b[i] - qb;
+    const float da = a[i] - qa;
+    result.add(3 * dr * dr + 4 * dg * dg + 2 * db * db + da * da, i);
+  }
+}
+
+#ifdef GIZA_HAVE_X86_SIMD
+
+// Combine per-lane results. The smallest lane minimum wins, and the second
+// smallest distance is the smallest of the other lane minima and all the
+// lane second minima.
+template <std::size_t N>
+void merge_lanes(const float* best, const float* second, const int* index, ScanResult& result)
+{
+  std::size_t lane = 0;
+  for (std::size_t i = 1; i < N; i++)
+    if (best[i] < best[lane])
+      lane = i;
+
+  result.best = best[lane];
+  result.index = static_cast<std::size_t>(index[lane]);
+  result.second = std::numeric_limits<float>::infinity();
+  for (std::size_t i = 0; i < N; i++)
+  {
+    result.second = std::min(result.second, second[i]);
+    if (i != lane)
+      result.second = std::min(result.second, best[i]);
+  }
+}
+
+__attribute__((target("avx2"))) void scan_avx2(const float* r,
+                                               const float* g,
+                                               const float* b,
+                                               const float* a,
+                                               std::size_t n,
+                                               const GammaColor& color,
+                                               ScanResult& result)
+{
+  const __m256 qr = _mm256_set1_ps(static_cast<float>(color.r));
+  const __m256 qg = _mm256_set1_ps(static_cast<float>(color.g));
+  const __m256 qb = _mm256_set1_ps(static_cast<float>(color.b));
+  const __m256 qa = _mm256_set1_ps(static_cast<float>(color.a));
+  const __m256 w2 = _mm256_set1_ps(2);
+  const __m256 w3 = _mm256_set1_ps(3);
+  const __m256 w4 = _mm256_set1_ps(4);
+
+  __m256 best = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  __m256 second = best;
+  __m256i bestindex = _mm256_setzero_si256();
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i step = _mm256_set1_epi32(8);
+
+  for (std::size_t i = 0; i < n; i += 8)
+  {
+    const __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(r + i), qr);
+    const __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(g + i), qg);
+    const __m256 db = _mm256_sub_ps(_mm256_loadu_ps(b + i), qb);
+    const __m256 da = _mm256_sub_ps(_mm256_loadu_ps(a + i), qa);
+
+    __m256 dist = _mm256_mul_ps(w3, _mm256_mul_ps(dr, dr));
+    dist = _mm256_add_ps(dist, _mm256_mul_ps(w4, _mm256_mul_ps(dg, dg)));
+    dist = _mm256_add_ps(dist, _mm256_mul_ps(w2, _mm256_mul_ps(db, db)));
+    dist = _mm256_add_ps(dist, _mm256_mul_ps(da, da));
+
+    const __m256 better = _mm256_cmp_ps(dist, best, _CMP_LT_OQ);
+    second = _mm256_blendv_ps(_mm256_min_ps(second, dist), best, better);
+    best = _mm256_blendv_ps(best, dist, better);
+    bestindex = _mm256_blendv_epi8(bestindex, index, _mm256_castps_si256(better));
+    index = _mm256_add_epi32(index, step);
+  }
+
+  alignas(32) float bests[8];
+  alignas(32) float seconds[8];
+  alignas(32) int indexes[8];
+  _mm256_store_ps(bests, best);
+  _mm256_store_ps(seconds, second);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(indexes), bestindex);
+  merge_lanes<8>(bests, seconds, indexes, result);
+}
+
+__attribute__((target("avx512f"))) void scan_avx512(const float* r,
+                                                    const float* g,
+                                                    const float* b,
+                                                    const float* a,
+                                                    std::size_t n,
+                                                    const GammaColor& color,
+                                                    ScanResult& result)
+{
+  const __m512 qr = _mm512_set1_ps(static_cast<float>(color.r));
+  const __m512 qg = _mm512_set1_ps(static_cast<float>(color.g));
+  const __m512 qb = _mm512_set1_ps(static_cast<float>(color.b));
+  const __m512 qa = _mm512_set1_ps(static_cast<float>(color.a));
+  const __m512 w2 = _mm512_set1_ps(2);
+  const __m512 w3 = _mm512_set1_ps(3);
+  const __m512 w4 = _mm512_set1_ps(4);
+
+  __m512 best = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+  __m512 second = best;
+  __m512i bestindex = _mm512_setzero_si512();
+  __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m512i step = _mm512_set1_epi32(16);
+
+  for (std::size_t i = 0; i < n; i += 16)
+  {
+    const __m512 dr = _mm512_sub_ps(_mm512_loadu_ps(r + i), qr);
+    const __m512 dg = _mm512_sub_ps(_mm512_loadu_ps(g + i), qg);
+    const __m512 db = _mm512_sub_ps(_mm512_loadu_ps(b + i), qb);
+    const __m512 da = _mm512_sub_ps(_mm512_loadu_ps(a + i), qa);
+
+    __m512 dist = _mm512_mul_ps(w3, _mm512_mul_ps(dr, dr));
+    dist = _mm512_add_ps(dist, _mm512_mul_ps(w4, _mm512_mul_ps(dg, dg)));
+    dist = _mm512_add_ps(dist, _mm512_mul_ps(w2, _mm512_mul_ps(db, db)));
+    dist = _mm512_add_ps(dist, _mm512_mul_ps(da, da));
+
+    const __mmask16 better = _mm512_cmp_ps_mask(dist, best, _CMP_LT_OQ);
+    second = _mm512_mask_min_ps(best, static_cast<__mmask16>(~better), second, dist);
+    best = _mm512_mask_blend_ps(better, best, dist);
+    bestindex = _mm512_mask_blend_epi32(better, bestindex, index);
+    index = _mm512_add_epi32(index, step);
+  }
+
+  alignas(64) float bests[16];
+  alignas(64) float seconds[16];
+  alignas(64) int indexes[16];
+  _mm512_store_ps(bests, best);
+  _mm512_store_ps(seconds, second);
+  _mm512_store_si512(indexes, bestindex);
+  merge_lanes<16>(bests, seconds, indexes, result);
+}
+
+#endif
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add a color to the set
+ */
+// ----------------------------------------------------------------------
+
+void ColorScan::insert(Color color, const GammaColor& colorgamma)
+{
+  try
+  {
+    const std::size_t pos = itsColors.size();
+    if (pos == itsR.size())
+    {
+      itsR.resize(pos + padding, far_away);
+      itsG.resize(pos + padding, far_away);
+      itsB.resize(pos + padding, far_away);
+      itsA.resize(pos + padding, far_away);
+    }
+    itsR[pos] = static_cast<float>(colorgamma.r);
+    itsG[pos] = static_cast<float>(colorgamma.g);
+    itsB[pos] = static_cast<float>(colorgamma.b);
+    itsA[pos] = static_cast<float>(colorgamma.a);
+    itsColors.push_back(color);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove all colors but keep the allocated memory
+ */
+// ----------------------------------------------------------------------
+
+void ColorScan::clear()
+{
+  itsR.clear();
+  itsG.clear();
+  itsB.clear();
+  itsA.clear();
+  itsColors.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest color by testing all the colors
+ *
+ * The single precision squared distances are accurate to roughly
+ * 2e-4*sqrt(d) + 3e-7*d. If the second best distance is not clearly
+ * larger than the best one, the colors might be ordered differently
+ * in double precision, or be an exact tie whose outcome depends on
+ * the tree structure, and the search is declined.
+ */
+// ----------------------------------------------------------------------
+
+bool ColorScan::nearest(const GammaColor& color, Color& nearest) const
+{
+  try
+  {
+    if (itsColors.empty())
+      return false;
+
+    ScanResult result;
+    const std::size_t n = itsR.size();
+
+#ifdef GIZA_HAVE_X86_SIMD
+    if (Simd::have_avx512())
+      scan_avx512(itsR.data(), itsG.data(), itsB.data(), itsA.data(), n, color, result);
+    else if (Simd::have_avx2())
+      scan_avx2(itsR.data(), itsG.data(), itsB.data(), itsA.data(), n, color, result);
+    else
+#endif
+      scan_scalar(itsR.data(), itsG.data(), itsB.data(), itsA.data(), n, color, result);
+
+    const double second = result.second;
+    const double margin = 2 * (1e-3 * std::sqrt(second) + 1e-6 * second) + 1e-6;
+    if (second - result.best <= margin)
+      return false;
+
+    nearest = itsColors[result.index];
+    return true;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Giza
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ColorTypes.h"
+#include <cstddef>
+#include <vector>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Exhaustive nearest color search for small color sets
+ *
+ * The gamma-corrected components are stored as structure-of-arrays
+ * floats, and the squared distance to all colors is evaluated 8 (AVX2)
+ * or 16 (AVX-512) at a time. For a few hundred colors this is faster
+ * than descending a near-tree.
+ *
+ * The search uses single precision, so it declines to choose between
+ * colors whose distances are too close to be ordered reliably. The owner
+ * (ColorTree) then answers the query itself, which keeps the results
+ * and the tie-breaking identical to the tree search.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+class ColorScan
+{
+ public:
+  void insert(Color color, const GammaColor& colorgamma);
+  std::size_t size() const { return itsColors.size(); }
+  void clear();
+
+  // Returns false if the set is empty or the nearest color is ambiguous
+  bool nearest(const GammaColor& color, Color& nearest) const;
+
+ private:
+  // Components padded to a multiple of the widest vector with far away colors
+  std::vector<float> itsR;
+  std::vector<float> itsG;
+  std::vector<float> itsB;
+  std::vector<float> itsA;
+  std::vector<Color> itsColors;
+};
+}  // namespace Giza
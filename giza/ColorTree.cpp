@@ -1,15 +1,19 @@
 #include "ColorTree.h"
-#include <boost/move/make_unique.hpp>
 #include <macgyver/Exception.h>
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <utility>
 
 namespace Giza
 {
 
 namespace
 {
+// Trees with at most this many colors are searched exhaustively. This covers
+// all final palettes, and the scan is several times faster at this size.
+constexpr std::size_t max_scan_colors = 256;
 
 /*
  * double gamma = 2.2f;
@@ -295,6 +299,16 @@ inline double gammacorr(int color)
  */
 // ----------------------------------------------------------------------
 
+// Interleave the bits of the color components, most significant bits first
+uint32_t morton_code(Color color)
+{
+  uint32_t code = 0;
+  for (int bit = 7; bit >= 0; bit--)
+    for (int shift = 0; shift < 32; shift += 8)
+      code = (code << 1) | ((color >> (shift + bit)) & 1U);
+  return code;
+}
+
 #if 0
 inline static double colordiff(double x, double y, double a)
 {
@@ -344,6 +358,14 @@ double ColorTree::distance(Color color1, Color color2)
   return distance(gamma(color1), gamma(color2));
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Construct an empty tree consisting of an empty root node
+ */
+// ----------------------------------------------------------------------
+
+ColorTree::ColorTree() : itsNodes(1), itsColors(1) {}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Test whether the tree is empty
@@ -352,7 +374,7 @@ double ColorTree::distance(Color color1, Color color2)
 
 bool ColorTree::empty() const
 {
-  return !has_leftcolor;
+  return !itsNodes[0].has_leftcolor;
 }
 // ----------------------------------------------------------------------
 /*!
@@ -362,11 +384,16 @@ bool ColorTree::empty() const
 
 int ColorTree::size() const
 {
-  return treesize;
+  return itsSize;
 }
 // ----------------------------------------------------------------------
 /*!
  * \brief Clear the tree of all colours
+ *
+ * The subtrees are dropped in O(1) while the pool keeps its capacity for
+ * the next round. The root node keeps its two colors and distance bounds,
+ * exactly as the original pointer based tree did, since the maxcolors
+ * restart loop in ColorMapper depends on the resulting behaviour.
  */
 // ----------------------------------------------------------------------
 
@@ -374,9 +401,51 @@ void ColorTree::clear()
 {
   try
   {
-    right = std::make_unique<ColorTree>();
-    left = std::make_unique<ColorTree>();
-    treesize = 0;
+    itsNodes.resize(1);
+    itsColors.resize(1);
+    itsNodes[0].left = none;
+    itsNodes[0].right = none;
+    itsSize = 0;
+
+    // Only the root colors remain
+    const Node& root = itsNodes[0];
+    itsScan.clear();
+    itsCount = 0;
+    if (root.has_leftcolor)
+    {
+      itsScan.insert(itsColors[0].leftcolor, root.leftgamma);
+      ++itsCount;
+    }
+    if (root.has_rightcolor)
+    {
+      itsScan.insert(itsColors[0].rightcolor, root.rightgamma);
+      ++itsCount;
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove all colours, root included
+ *
+ * Unlike clear(), this returns the tree to its initial state. The pool
+ * keeps its capacity, so a tree can be reused without reallocating.
+ */
+// ----------------------------------------------------------------------
+
+void ColorTree::reset()
+{
+  try
+  {
+    itsNodes.assign(1, Node());
+    itsColors.assign(1, NodeColors());
+    itsSize = 0;
+    itsScan.clear();
+    itsCount = 0;
   }
   catch (...)
   {
@@ -412,48 +481,62 @@ void ColorTree::insert(Color color, const GammaColor& colorgamma)
 {
   try
   {
-    if (!has_leftcolor)
-    {
-      leftcolor = color;
-      leftgamma = colorgamma;
-      has_leftcolor = true;
-    }
+    if (++itsCount <= max_scan_colors)
+      itsScan.insert(color, colorgamma);
 
-    else if (!has_rightcolor)
+    uint32_t node = 0;
+    while (true)
     {
-      rightcolor = color;
-      rightgamma = colorgamma;
-      has_rightcolor = true;
-    }
+      Node& current = itsNodes[node];
 
-    else
-    {
-      const double dist_left = distance(colorgamma, leftgamma);
-      const double dist_right = distance(colorgamma, rightgamma);
+      if (!current.has_leftcolor)
+      {
+        itsColors[node].leftcolor = color;
+        current.leftgamma = colorgamma;
+        current.has_leftcolor = true;
+        return;
+      }
 
-      if (dist_left > dist_right)
+      if (!current.has_rightcolor)
       {
-        if (right == nullptr)
-          right = std::make_unique<ColorTree>();
+        itsColors[node].rightcolor = color;
+        current.rightgamma = colorgamma;
+        current.has_rightcolor = true;
+        return;
+      }
 
-        // note that constructor sets maxright to be negative
+      const double dist_left = distance(colorgamma, current.leftgamma);
+      const double dist_right = distance(colorgamma, current.rightgamma);
 
-        maxright = std::max(maxright, dist_right);
+      if (node == 0)
+        ++itsSize;
 
-        right->insert(color, colorgamma);
-        ++treesize;
+      // Note that new nodes start with negative maxleft and maxright. Adding a
+      // node may reallocate the pool, so 'current' is not used after it.
+
+      if (dist_left > dist_right)
+      {
+        current.maxright = std::max(current.maxright, dist_right);
+        if (current.right == none)
+        {
+          const auto child = static_cast<uint32_t>(itsNodes.size());
+          itsNodes.emplace_back();
+          itsColors.emplace_back();
+          itsNodes[node].right = child;
+        }
+        node = itsNodes[node].right;
       }
       else
       {
-        if (left == nullptr)
-          left = std::make_unique<ColorTree>();
-
-        // note that constructor sets maxleft to be negative
-
-        maxleft = std::max(maxleft, dist_left);
-
-        left->insert(color, colorgamma);
-        ++treesize;
+        current.maxleft = std::max(current.maxleft, dist_left);
+        if (current.left == none)
+        {
+          const auto child = static_cast<uint32_t>(itsNodes.size());
+          itsNodes.emplace_back();
+          itsColors.emplace_back();
+          itsNodes[node].left = child;
+        }
+        node = itsNodes[node].left;
       }
     }
   }
@@ -486,12 +569,86 @@ Color ColorTree::nearest(Color color)
 }
 
 Color ColorTree::nearest(Color color, double& distance)
+{
+  try
+  {
+    return search(gamma(color), distance);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest colors for many colors
+ *
+ * The gamma corrections are done first for all the colors. Large trees
+ * are then searched in Morton order of the colors, so that consecutive
+ * searches mostly walk the same nodes of the tree.
+ *
+ * \param colors The colors for which to find the nearest colors
+ * \param n The number of colors
+ * \param nearest The output nearest colors, n elements
+ * \param distances The output distances to the nearest colors, n elements
+ */
+// ----------------------------------------------------------------------
+
+void ColorTree::nearest(const Color* colors,
+                        std::size_t n,
+                        Color* nearest,
+                        double* distances) const
+{
+  try
+  {
+    std::vector<GammaColor> gammas(n);
+    for (std::size_t i = 0; i < n; i++)
+      gammas[i] = gamma(colors[i]);
+
+    // Small trees are scanned, the order does not matter
+    if (itsCount <= max_scan_colors)
+    {
+      for (std::size_t i = 0; i < n; i++)
+        nearest[i] = search(gammas[i], distances[i]);
+      return;
+    }
+
+    // Process similar colors consecutively so that they walk the same nodes
+    std::vector<std::pair<uint32_t, uint32_t>> order(n);
+    for (std::size_t i = 0; i < n; i++)
+      order[i] = {morton_code(colors[i]), static_cast<uint32_t>(i)};
+    std::sort(order.begin(), order.end());
+
+    for (const auto& item : order)
+      nearest[item.second] = search(gammas[item.second], distances[item.second]);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest color for a gamma corrected color
+ */
+// ----------------------------------------------------------------------
+
+Color ColorTree::search(const GammaColor& color, double& distance) const
 {
   try
   {
     Color bestcolor = 0;
+    if (itsCount <= max_scan_colors && itsScan.nearest(color, bestcolor))
+    {
+      // Same rounding as in the tree search
+      distance = static_cast<float>(ColorTree::distance(color, gamma(bestcolor)));
+      return bestcolor;
+    }
+
     double radius = -1;
-    if (!nearest(gamma(color), bestcolor, radius))
+    if (!nearest(0, color, bestcolor, radius))
       throw Fmi::Exception(BCP, "Invalid use of color reduction tables: no match was found");
     distance = radius;
     return bestcolor;
@@ -510,10 +667,15 @@ Color ColorTree::nearest(Color color, double& distance)
  */
 // ----------------------------------------------------------------------
 
-bool ColorTree::nearest(const GammaColor& color, Color& nearest, double& radius) const
+bool ColorTree::nearest(uint32_t node,
+                        const GammaColor& color,
+                        Color& nearest,
+                        double& radius) const
 {
   try
   {
+    const Node& current = itsNodes[node];
+
     float left_dist = -1;
     float right_dist = -1;
     bool found = false;
@@ -521,24 +683,24 @@ bool ColorTree::nearest(const GammaColor& color, Color& nearest, double& radius)
     // first test each of the left and right positions to see if
     // one holds a color nearer than the nearest so far discovered
 
-    if (has_leftcolor)
+    if (current.has_leftcolor)
     {
-      left_dist = distance(color, leftgamma);
+      left_dist = distance(color, current.leftgamma);
       if (radius < 0 || left_dist <= radius)
       {
         radius = left_dist;
-        nearest = leftcolor;
+        nearest = itsColors[node].leftcolor;
         found = true;
       }
     }
 
-    if (has_rightcolor)
+    if (current.has_rightcolor)
     {
-      right_dist = distance(color, rightgamma);
+      right_dist = distance(color, current.rightgamma);
       if (radius < 0 || right_dist <= radius)
       {
         radius = right_dist;
-        nearest = rightcolor;
+        nearest = itsColors[node].rightcolor;
         found = true;
       }
     }
@@ -560,19 +722,19 @@ bool ColorTree::nearest(const GammaColor& color, Color& nearest, double& radius)
 
     const bool left_closer = (left_dist < right_dist);
 
-    if (!left_closer && (right != nullptr) && ((radius + maxright) >= right_dist))
+    if (!left_closer && (current.right != none) && ((radius + current.maxright) >= right_dist))
     {
-      found |= right->nearest(color, nearest, radius);
+      found |= this->nearest(current.right, color, nearest, radius);
     }
 
-    if ((left != nullptr) && ((radius + maxleft) >= left_dist))
+    if ((current.left != none) && ((radius + current.maxleft) >= left_dist))
     {
-      found |= left->nearest(color, nearest, radius);
+      found |= this->nearest(current.left, color, nearest, radius);
     }
 
-    if (left_closer && (right != nullptr) && ((radius + maxright) >= right_dist))
+    if (left_closer && (current.right != none) && ((radius + current.maxright) >= right_dist))
     {
-      found |= right->nearest(color, nearest, radius);
+      found |= this->nearest(current.right, color, nearest, radius);
     }
 
     return found;
@@ -1,7 +1,10 @@
 #pragma once
 
+#include "ColorScan.h"
 #include "ColorTypes.h"
-#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 // ----------------------------------------------------------------------
 /*!
@@ -10,26 +13,19 @@
  * The idea is to feed in colors in the order of their popularity
  * and then use the near-tree maximum distance information
  * to group colors for color reduction.
+ *
+ * While the tree is small, nearest() uses an exhaustive vectorized
+ * search instead, falling back to the tree for ambiguous cases so that
+ * the results do not depend on which search was used.
  */
 // ----------------------------------------------------------------------
 
 namespace Giza
 {
-// Gamma-corrected color components, precomputed once per stored color so that
-// distance evaluations in the hot nearest()/insert() paths avoid repeated
-// gamma table lookups.
-struct GammaColor
-{
-  double r = 0;
-  double g = 0;
-  double b = 0;
-  double a = 0;
-};
-
 class ColorTree
 {
  public:
-  ColorTree() = default;
+  ColorTree();
   ColorTree(const ColorTree& other) = delete;
   ColorTree& operator=(const ColorTree& other) = delete;
   ColorTree(ColorTree&& other) = delete;
@@ -38,12 +34,17 @@ class ColorTree
   void insert(Color color);
   int size() const;
   void clear();
+  void reset();
   bool empty() const;
   Color nearest(Color color);
   // Also returns the perceptual distance to the nearest color, so callers need
   // not recompute it.
   Color nearest(Color color, double& distance);
 
+  // Nearest colors and their distances for n colors at once. The results are
+  // the same as from calling nearest(color, distance) for each color.
+  void nearest(const Color* colors, std::size_t n, Color* nearest, double* distances) const;
+
   static double distance(Color color1, Color color2);
 
  private:
@@ -51,18 +52,40 @@ class ColorTree
   static double distance(const GammaColor& color1, const GammaColor& color2);
 
   void insert(Color color, const GammaColor& colorgamma);
-  bool nearest(const GammaColor& color, Color& nearest, double& radius) const;
+  Color search(const GammaColor& color, double& distance) const;
+  bool nearest(uint32_t node, const GammaColor& color, Color& nearest, double& radius) const;
+
+  // The nodes are stored in a pool and refer to their subtrees by index.
+  // The root is node 0, which can never be a subtree, so 0 marks a missing
+  // subtree. The data needed while searching is kept apart from the colors,
+  // which are only read when a nearer match is found.
+
+  static constexpr uint32_t none = 0;
+
+  struct Node
+  {
+    GammaColor leftgamma;
+    GammaColor rightgamma;
+    double maxleft = -1.0;
+    double maxright = -1.0;
+    uint32_t left = none;
+    uint32_t right = none;
+    bool has_leftcolor = false;
+    bool has_rightcolor = false;
+  };
+
+  struct NodeColors
+  {
+    Color leftcolor = 0;
+    Color rightcolor = 0;
+  };
+
+  std::vector<Node> itsNodes;
+  std::vector<NodeColors> itsColors;
+  int itsSize = 0;  // number of colors below the root node
 
-  double maxleft = -1.0;
-  double maxright = -1.0;
-  int treesize = 0;
-  bool has_leftcolor = false;
-  bool has_rightcolor = false;
-  Color leftcolor = 0;
-  Color rightcolor = 0;
-  GammaColor leftgamma;
-  GammaColor rightgamma;
-  std::unique_ptr<ColorTree> left;
-  std::unique_ptr<ColorTree> right;
+  // Small trees are searched exhaustively with a copy of all the colors
+  ColorScan itsScan;
+  std::size_t itsCount = 0;  // number of colors in the tree
 };
 }  // namespace Giza
@@ -14,6 +14,17 @@ using Count = uint32_t;
 using ColorMap = std::unordered_map<Color, Color>;
 using Histogram = std::multimap<Count, Color, std::greater<std::size_t>>;
 
+// Gamma-corrected color components, precomputed once per stored color so that
+// distance evaluations in the hot nearest()/insert() paths avoid repeated
+// gamma table lookups.
+struct GammaColor
+{
+  double r = 0;
+  double g = 0;
+  double b = 0;
+  double a = 0;
+};
+
 inline unsigned char alpha(Color color)
 {
   return (color >> 24) & 0xFF;
@@ -0,0 +1,197 @@
+#include "DenseColorMap.h"
+#include <macgyver/Exception.h>
+#include <algorithm>
+#include <utility>
+
+namespace Giza
+{
+namespace
+{
+// The empty-slot sentinel is a color that cannot occur: a Cairo ARGB32 surface
+// is premultiplied, so any pixel with alpha 0 has RGB 0, making this alpha-0
+// value with non-zero RGB impossible.
+constexpr Color EMPTY_SLOT = 0x00000001U;
+
+// Multiplicative (Fibonacci) hash, see FlatHistogram in ColorMapper.cpp
+inline uint32_t color_hash(Color c)
+{
+  return c * 2654435761U;
+}
+
+// Tables this large (3 MB) do not fit in the L2 cache, and the slots of
+// upcoming pixels are prefetched while mapping
+constexpr std::size_t min_prefetch_slots = std::size_t{1} << 18;
+
+// How many pixels ahead to prefetch
+constexpr std::size_t prefetch_distance = 16;
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the table
+ */
+// ----------------------------------------------------------------------
+
+DenseColorMap::DenseColorMap(const ColorMap& colormap, const std::vector<Color>& palette)
+{
+  assign(colormap, palette);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Rebuild the table, reusing the allocated slots when possible
+ *
+ * Colors which are not in the palette get index 0. The palette is empty
+ * for true color images, whose indices are not used.
+ */
+// ----------------------------------------------------------------------
+
+void DenseColorMap::assign(const ColorMap& colormap, const std::vector<Color>& palette)
+{
+  try
+  {
+    // The palette is small, a sorted array is enough for finding the indices
+    std::vector<std::pair<Color, uint8_t>> indices;
+    indices.reserve(palette.size());
+    for (std::size_t i = 0; i < palette.size(); i++)
+      indices.emplace_back(palette[i], static_cast<uint8_t>(i));
+    std::sort(indices.begin(), indices.end());
+
+    std::size_t cap = 16;
+    itsShift = 28;  // 32 - log2(16)
+    while (cap < 2 * colormap.size() && itsShift > 1)
+    {
+      cap <<= 1;
+      --itsShift;
+    }
+    itsSlots.assign(cap, Slot{EMPTY_SLOT, Entry{0, 0}});
+    itsMask = static_cast<uint32_t>(cap - 1);
+    itsMaxProbe = 0;
+
+    for (const auto& item : colormap)
+    {
+      const auto pos = std::lower_bound(
+          indices.begin(), indices.end(), std::make_pair(item.second, uint8_t{0}));
+      const uint8_t index = (pos != indices.end() && pos->first == item.second ? pos->second : 0);
+
+      uint32_t h = color_hash(item.first) >> itsShift;
+      uint32_t probe = 0;
+      while (itsSlots[h].key != EMPTY_SLOT)
+      {
+        h = (h + 1) & itsMask;
+        ++probe;
+      }
+      itsSlots[h] = Slot{item.first, Entry{item.second, index}};
+      itsMaxProbe = std::max(itsMaxProbe, probe);
+    }
+    itsSize = colormap.size();
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Empty the table, keeping the allocated slots for reuse
+ */
+// ----------------------------------------------------------------------
+
+void DenseColorMap::clear()
+{
+  itsSize = 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the replacement of a color
+ */
+// ----------------------------------------------------------------------
+
+const DenseColorMap::Entry& DenseColorMap::at(Color color) const
+{
+  if (itsSize == 0)
+    throw Fmi::Exception(BCP, "Color map has not been calculated");
+
+  // No color is further than the longest probe sequence seen while building
+
+  uint32_t h = color_hash(color) >> itsShift;
+  for (uint32_t probe = 0; probe <= itsMaxProbe; probe++)
+  {
+    const Slot& slot = itsSlots[h];
+    if (slot.key == color)
+      return slot.entry;
+    h = (h + 1) & itsMask;
+  }
+  throw Fmi::Exception(BCP, "Color missing from the color map");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map pixels to their replacements
+ */
+// ----------------------------------------------------------------------
+
+void DenseColorMap::map(const Color* pixels,
+                        std::size_t n,
+                        Color* colors,
+                        std::uint8_t* indices) const
+{
+  try
+  {
+    // Remember last color conversions for extra speed. The initial colors
+    // cannot occur in the image.
+
+    Color last_color1 = EMPTY_SLOT;
+    Entry last_choice1{0, 0};
+    Color last_color2 = EMPTY_SLOT;
+    Entry last_choice2{0, 0};
+
+    auto map_pixel = [&](std::size_t i)
+    {
+      const Color color = pixels[i];
+      if (color != last_color1)
+      {
+        if (color == last_color2)
+        {
+          std::swap(last_color1, last_color2);
+          std::swap(last_choice1, last_choice2);
+        }
+        else
+        {
+          last_color2 = last_color1;
+          last_choice2 = last_choice1;
+          last_color1 = color;
+          last_choice1 = at(color);
+        }
+      }
+      if (colors != nullptr)
+        colors[i] = last_choice1.color;
+      if (indices != nullptr)
+        indices[i] = last_choice1.index;
+    };
+
+    // Large tables are probed at practically random positions, hide the
+    // cache misses by fetching the slots of upcoming pixels in advance
+
+    std::size_t i = 0;
+    if (itsSlots.size() >= min_prefetch_slots)
+    {
+      for (; i + prefetch_distance < n; i++)
+      {
+        __builtin_prefetch(&itsSlots[color_hash(pixels[i + prefetch_distance]) >> itsShift]);
+        map_pixel(i);
+      }
+    }
+    for (; i < n; i++)
+      map_pixel(i);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Giza
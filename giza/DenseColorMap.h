@@ -0,0 +1,58 @@
+#pragma once
+
+#include "ColorTypes.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Flat color replacement table
+ *
+ * Maps each color of an image to its replacement color and the palette
+ * index of the replacement. The table is built once from the ColorMap and
+ * the palette, and is much faster to probe per pixel than the node based
+ * ColorMap.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+class DenseColorMap
+{
+ public:
+  struct Entry
+  {
+    Color color;
+    std::uint8_t index;
+  };
+
+  DenseColorMap() = default;
+  DenseColorMap(const ColorMap& colormap, const std::vector<Color>& palette);
+
+  void assign(const ColorMap& colormap, const std::vector<Color>& palette);
+  void clear();
+  bool empty() const { return itsSize == 0; }
+
+  // Throws if the color is not in the table. The number of probed slots is
+  // bounded by the longest collision chain built into the table.
+  const Entry& at(Color color) const;
+
+  // Map n pixels to their replacement colors and/or palette indices. Either
+  // output may be null, and colors may be the same array as pixels.
+  void map(const Color* pixels, std::size_t n, Color* colors, std::uint8_t* indices) const;
+
+ private:
+  struct Slot
+  {
+    Color key;
+    Entry entry;
+  };
+
+  std::vector<Slot> itsSlots;
+  std::size_t itsSize = 0;
+  std::uint32_t itsMask = 0;
+  std::uint32_t itsShift = 0;
+  std::uint32_t itsMaxProbe = 0;  // longest probe sequence needed for any color
+};
+}  // namespace Giza
@@ -0,0 +1,1741 @@
+#include "Encoder.h"
+#include "ColorMapper.h"
+#include "FixedPalette.h"
+#include "OutputCache.h"
+#include "Parallel.h"
+#include "PngOptions.h"
+#include "Simd.h"
+#include "WebpOptions.h"
+#include <cairo/cairo.h>
+#include <macgyver/Exception.h>
+#include <webp/encode.h>
+#include <webp/mux.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <libdeflate.h>
+#include <map>
+#include <mutex>
+#include <png.h>
+#include <tuple>
+#include <vector>
+#include <zlib.h>
+
+namespace Giza
+{
+namespace
+{
+/* Unpremultiply a single colour component */
+
+png_byte unpremultiply_color_component(png_byte component, png_byte alpha)
+{
+  try
+  {
+    if (alpha == 0)
+      return 0;
+
+    return (component * 255 + alpha / 2) / alpha;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
+void unpremultiply_data(png_structp /* png */, png_row_infop row_info, png_bytep data)
+{
+  try
+  {
+    unsigned int i;
+
+    for (i = 0; i < row_info->rowbytes; i += 4)
+    {
+      uint8_t *b = &data[i];
+      uint32_t pixel;
+      uint8_t alpha;
+
+      memcpy(&pixel, b, sizeof(uint32_t));
+      alpha = (pixel & 0xff000000U) >> 24;
+      if (alpha == 0)
+      {
+        b[0] = b[1] = b[2] = b[3] = 0;  // normalize fully transparent colours
+      }
+      else
+      {
+        b[0] = (((pixel & 0xff0000U) >> 16) * 255 + alpha / 2) / alpha;
+        b[1] = (((pixel & 0x00ff00U) >> 8) * 255 + alpha / 2) / alpha;
+        b[2] = (((pixel & 0x0000ffU) >> 0) * 255 + alpha / 2) / alpha;
+        b[3] = alpha;
+      }
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Cairo callback for writing image chunks
+
+void append_to_string(png_structp png, png_bytep data, png_size_t length)
+{
+  try
+  {
+    auto *buffer = reinterpret_cast<std::string *>(png_get_io_ptr(png));
+    buffer->append(reinterpret_cast<const char *>(data), length);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Convert premultiplied ARGB32 surface data in place to unpremultiplied ARGB, which
+// is also the native pixel layout of libwebp lossless pictures, and make the picture
+// refer to the surface data instead of a copy of it.
+
+void surface_to_webp_picture(cairo_surface_t *image, WebPPicture &pic)
+{
+  try
+  {
+    cairo_surface_flush(image);
+
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      throw Fmi::Exception(BCP, "Giza::towebp can write only Cairo ARGB32 format images");
+
+    // Access image data directly.
+    unsigned char *data = cairo_image_surface_get_data(image);
+
+    if (data == nullptr)
+      throw Fmi::Exception(BCP, "Attempt to render an invalid Cairo image as WEBP");
+
+    // The cairo image data may have a stride width, meaning once you have
+    // passed a certain width you may have to skip more bytes to reach the next
+    // row. Hence the position of the next row is calculated using the stride,
+    // and not the width.
+
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+
+    // Unpremultiplying by alpha. Opaque colours need no changes.
+
+    for (int i = 0; i < height; i++)
+    {
+      uint *row = (uint *)(data + i * stride);
+      for (int x = 0; x < width; x++)
+      {
+        uint col = row[x];
+        uint8_t alpha = (col & 0xff000000U) >> 24;
+        if (alpha == 0xff)
+          continue;
+        if (alpha == 0)
+          row[x] = 0;  // normalize fully transparent colours
+        else
+        {
+          uint r = (((col & 0xff0000U) >> 16) * 255 + alpha / 2) / alpha;
+          uint g = (((col & 0x00ff00U) >> 8) * 255 + alpha / 2) / alpha;
+          uint b = (((col & 0x0000ffU) >> 0) * 255 + alpha / 2) / alpha;
+          row[x] = (col & 0xff000000U) | (r << 16) | (g << 8) | b;
+        }
+      }
+    }
+
+    // A view to the pixels in the manner of WebPPictureView. WebPPictureFree
+    // releases only memory allocated by libwebp, not the view.
+
+    pic.use_argb = 1;
+    pic.width = width;
+    pic.height = height;
+    pic.argb = reinterpret_cast<uint32_t *>(data);
+    pic.argb_stride = stride / 4;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+void giza_surface_write_to_webp_string(cairo_surface_t *image,
+                                       std::string &buffer,
+                                       const WebpOptions &options)
+{
+  try
+  {
+    WebPConfig config;
+    if (options.level < 0)
+    {
+      // Default: the configuration of libwebp's simple lossless API, which
+      // preserves the historical output of WebPEncodeLosslessRGBA
+      if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, 70.0f))
+        throw Fmi::Exception(BCP, "Failed to initialize libwebp configuration");
+      config.lossless = 1;
+    }
+    else
+    {
+      // Explicit speed control: the lossless preset level (0 = fastest/largest
+      // ... 9 = slowest/smallest)
+      if (!WebPConfigInit(&config))
+        throw Fmi::Exception(BCP, "Failed to initialize libwebp configuration");
+      config.lossless = 1;
+      if (!WebPConfigLosslessPreset(&config, std::clamp(options.level, 0, 9)))
+        throw Fmi::Exception(BCP, "Invalid libwebp lossless preset level");
+    }
+    if (!WebPValidateConfig(&config))
+      throw Fmi::Exception(BCP, "Invalid libwebp configuration");
+
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic))
+      throw Fmi::Exception(BCP, "Failed to initialize libwebp picture");
+    surface_to_webp_picture(image, pic);
+
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    pic.writer = WebPMemoryWrite;
+    pic.custom_ptr = &writer;
+
+    try
+    {
+      if (!WebPEncode(&config, &pic))
+        throw Fmi::Exception(BCP, "libwebp encoding failed")
+            .addParameter("error_code", std::to_string(pic.error_code));
+
+      buffer.append(reinterpret_cast<const char *>(writer.mem), writer.size);
+    }
+    catch (...)
+    {
+      WebPMemoryWriterClear(&writer);
+      WebPPictureFree(&pic);
+      throw;
+    }
+
+    WebPMemoryWriterClear(&writer);
+    WebPPictureFree(&pic);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Access to the rows of an image being encoded
+ *
+ * Either ColorMapper::reduce has already replaced the colors in the image
+ * and calculated the palette indices, or the color map is applied on the
+ * fly to each row as it is requested, leaving the image untouched.
+ */
+// ----------------------------------------------------------------------
+
+class PixelRows
+{
+ public:
+  PixelRows(cairo_surface_t *image, const ColorMapper &mapper, bool fused)
+      : itsMapper(mapper), itsFused(fused)
+  {
+    cairo_surface_flush(image);
+
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      throw Fmi::Exception(BCP, "Giza::topng can write only Cairo ARGB32 format images");
+
+    itsData = cairo_image_surface_get_data(image);
+    if (itsData == nullptr)
+      throw Fmi::Exception(BCP, "Attempt to render an invalid Cairo image as PNG");
+
+    // The cairo image data may have a stride width, meaning once you have
+    // passed a certain width you may have to skip more bytes to reach the next
+    // row. Hence the position of the next row is calculated using the stride,
+    // and not the width.
+
+    itsWidth = cairo_image_surface_get_width(image);
+    itsHeight = cairo_image_surface_get_height(image);
+    itsStride = cairo_image_surface_get_stride(image);
+
+    if (itsFused)
+    {
+      itsColors.resize(itsWidth);
+      itsIndices.resize(itsWidth);
+    }
+    else if (!mapper.palette().empty() &&
+             mapper.indices().size() != static_cast<std::size_t>(itsWidth) * itsHeight)
+      throw Fmi::Exception(BCP, "Palette indices have not been calculated for the image");
+  }
+
+  int width() const { return itsWidth; }
+  int height() const { return itsHeight; }
+
+  // The colors of a row after the color reduction
+  const Color *colors(int row)
+  {
+    if (!itsFused)
+      return pixels(row);
+    itsMapper.mapColors(pixels(row), itsWidth, itsColors.data());
+    return itsColors.data();
+  }
+
+  // The palette indices of a row
+  const uint8_t *indices(int row)
+  {
+    if (!itsFused)
+      return itsMapper.indices().data() + static_cast<std::size_t>(row) * itsWidth;
+    itsMapper.mapIndices(pixels(row), itsWidth, itsIndices.data());
+    return itsIndices.data();
+  }
+
+ private:
+  const Color *pixels(int row) const
+  {
+    return reinterpret_cast<const Color *>(itsData + static_cast<std::size_t>(row) * itsStride);
+  }
+
+  const ColorMapper &itsMapper;
+  bool itsFused;
+  const unsigned char *itsData = nullptr;
+  int itsWidth = 0;
+  int itsHeight = 0;
+  int itsStride = 0;
+  std::vector<Color> itsColors;     // reduced row in fused mode
+  std::vector<uint8_t> itsIndices;  // row indices in fused mode
+};
+
+// --- Minimal PNG container writer compressing IDAT with libdeflate ---------------------
+//
+// By default giza writes unfiltered scanlines (PNG_FILTER_NONE), so the IDAT input is simply
+// a 0x00 filter byte followed by the raw row bytes per row. True color scanlines may also be
+// filtered as selected by PngOptions::filter. PNG's IDAT payload is a zlib
+// datastream, which is exactly what libdeflate_zlib_compress() produces, and PNG chunk CRCs
+// are the standard CRC-32 that libdeflate_crc32() computes. This lets us bypass libpng (and
+// its streaming zlib) and use libdeflate's faster one-shot compressor.
+
+void put_be32(std::string &out, uint32_t value)
+{
+  out.push_back(static_cast<char>((value >> 24) & 0xff));
+  out.push_back(static_cast<char>((value >> 16) & 0xff));
+  out.push_back(static_cast<char>((value >> 8) & 0xff));
+  out.push_back(static_cast<char>(value & 0xff));
+}
+
+// Append a PNG chunk: length, 4-byte type, data, CRC-32 over (type + data).
+void png_chunk(std::string &out, const char *type, const uint8_t *data, size_t len)
+{
+  put_be32(out, static_cast<uint32_t>(len));
+  const size_t crc_begin = out.size();
+  out.append(type, 4);
+  if (len > 0)
+    out.append(reinterpret_cast<const char *>(data), len);
+  const auto crc = libdeflate_crc32(0, out.data() + crc_begin, 4 + len);
+  put_be32(out, crc);
+}
+
+// libdeflate compression level (1..12). Default 1 favors speed (as the previous zlib level 3
+// did) while still producing slightly smaller output than zlib level 3, and is measurably
+// faster. Overridable via GIZA_PNG_LEVEL for benchmarking or when smaller files are preferred.
+int libdeflate_level()
+{
+  if (const char *env = std::getenv("GIZA_PNG_LEVEL"))
+  {
+    const int level = std::atoi(env);
+    if (level >= 1 && level <= 12)
+      return level;
+  }
+  return 1;
+}
+
+// Layout of the PNG image data, and the palette tables for palette images. There are
+// at most 256 palette colors.
+struct PngFormat
+{
+  int colortype = 6;  // 0 = gray, 2 = RGB, 3 = palette, 4 = gray+alpha, 6 = RGBA
+  int bitdepth = 8;   // bits per sample or palette index
+  uint8_t plte[3 * 256];  // NOLINT RGB triplets
+  uint8_t trns[256];      // NOLINT leading transparent alphas
+  std::size_t plte_size = 0;
+  std::size_t trns_size = 0;
+
+  bool palette() const { return colortype == 3; }
+
+  // Bits per pixel
+  int bits() const
+  {
+    const int channels = (colortype == 2 ? 3 : colortype == 4 ? 2 : colortype == 6 ? 4 : 1);
+    return bitdepth * channels;
+  }
+
+  // Bytes per complete pixel, the distance used by the scanline filters
+  std::size_t bpp() const { return std::max(1, bits() / 8); }
+
+  // Size of a scanline including the filter type byte
+  std::size_t rowbytes(int width) const
+  {
+    return 1 + (static_cast<std::size_t>(width) * bits() + 7) / 8;
+  }
+};
+
+// Palette mode with the smallest bit depth which fits all the indices
+void png_palette(const Color *palette, std::size_t colors, PngFormat &format)
+{
+  format.colortype = 3;
+  format.bitdepth = (colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8);
+
+  // Palette indices are in use-count order (same as the libpng path). Note that
+  // transparent colors are no longer guaranteed to come first, so tRNS may extend
+  // further into the palette than with the old alpha-ascending ordering.
+  auto &plte_size = format.plte_size;
+  plte_size = 0;
+  int num_transparent = 0;
+  for (std::size_t idx = 0; idx < colors; idx++)
+  {
+    const Color color = palette[idx];
+    const auto a = alpha(color);
+    format.plte[plte_size++] = unpremultiply_color_component(red(color), a);
+    format.plte[plte_size++] = unpremultiply_color_component(green(color), a);
+    format.plte[plte_size++] = unpremultiply_color_component(blue(color), a);
+    format.trns[idx] = a;
+    if (a < 255)
+      num_transparent = static_cast<int>(idx) + 1;
+  }
+  format.trns_size = num_transparent;  // keep only the leading transparent entries
+}
+
+// Choose between true color and palette mode, and fill the palette tables for the
+// latter. Palette images use the smallest bit depth which fits all the indices, and
+// true color images drop the alpha channel or the color components when possible.
+void png_format(const ColorMapper &mapper, PngFormat &format)
+{
+  // Same truecolor-vs-palette decision as the libpng path. The palette colors
+  // are ordered by descending use count, which is also the palette index order.
+  const auto &palette = mapper.palette();
+  if (mapper.trueColor() || palette.size() > 256)
+  {
+    if (mapper.gray())
+      format.colortype = (mapper.opaque() ? 0 : 4);
+    else
+      format.colortype = (mapper.opaque() ? 2 : 6);
+    format.bitdepth = 8;
+    return;
+  }
+
+  png_palette(palette.data(), palette.size(), format);
+}
+
+// Write the raw (unfiltered) scanlines of rows [row1,row2) to out
+void png_scanlines(PixelRows &rows, const PngFormat &format, int row1, int row2, uint8_t *out)
+{
+  try
+  {
+    const int width = rows.width();
+
+    if (format.colortype == 6)
+    {
+      for (int i = row1; i < row2; i++)
+      {
+        const Color *row = rows.colors(i);
+        *out++ = 0;  // PNG_FILTER_NONE
+        for (int j = 0; j < width; j++)
+        {
+          const uint32_t pixel = row[j];
+          const uint8_t a = (pixel & 0xff000000U) >> 24;
+          if (a == 0)
+          {
+            out[0] = out[1] = out[2] = out[3] = 0;  // normalize fully transparent pixels
+          }
+          else
+          {
+            out[0] = (((pixel & 0xff0000U) >> 16) * 255 + a / 2) / a;
+            out[1] = (((pixel & 0x00ff00U) >> 8) * 255 + a / 2) / a;
+            out[2] = (((pixel & 0x0000ffU) >> 0) * 255 + a / 2) / a;
+            out[3] = a;
+          }
+          out += 4;
+        }
+      }
+    }
+    else if (format.colortype == 2)
+    {
+      // Opaque colors are not premultiplied
+      for (int i = row1; i < row2; i++)
+      {
+        const Color *row = rows.colors(i);
+        *out++ = 0;  // PNG_FILTER_NONE
+        for (int j = 0; j < width; j++)
+        {
+          const uint32_t pixel = row[j];
+          out[0] = (pixel >> 16) & 0xff;
+          out[1] = (pixel >> 8) & 0xff;
+          out[2] = pixel & 0xff;
+          out += 3;
+        }
+      }
+    }
+    else if (format.colortype == 0)
+    {
+      for (int i = row1; i < row2; i++)
+      {
+        const Color *row = rows.colors(i);
+        *out++ = 0;  // PNG_FILTER_NONE
+        for (int j = 0; j < width; j++)
+          *out++ = row[j] & 0xff;
+      }
+    }
+    else if (format.colortype == 4)
+    {
+      for (int i = row1; i < row2; i++)
+      {
+        const Color *row = rows.colors(i);
+        *out++ = 0;  // PNG_FILTER_NONE
+        for (int j = 0; j < width; j++)
+        {
+          const uint32_t pixel = row[j];
+          const uint8_t a = (pixel & 0xff000000U) >> 24;
+          out[0] = (a == 0 ? 0 : ((pixel & 0xffU) * 255 + a / 2) / a);
+          out[1] = a;
+          out += 2;
+        }
+      }
+    }
+    else if (format.bitdepth == 8)
+    {
+      const size_t rowbytes = static_cast<size_t>(width);
+      for (int i = row1; i < row2; i++)
+      {
+        *out++ = 0;  // PNG_FILTER_NONE
+        std::memcpy(out, rows.indices(i), rowbytes);
+        out += rowbytes;
+      }
+    }
+    else
+    {
+      const size_t rowbytes = format.rowbytes(width) - 1;
+      for (int i = row1; i < row2; i++)
+      {
+        *out++ = 0;  // PNG_FILTER_NONE
+        Simd::pack_indices(rows.indices(i), width, format.bitdepth, out);
+        out += rowbytes;
+      }
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Scratch space needed for filtering: the prior scanline, a copy of the last scanline of a
+// band, the four filtered candidates of a scanline and the filtered scanline
+std::size_t png_filter_scratch(std::size_t rowbytes)
+{
+  return 7 * (rowbytes - 1);
+}
+
+// Filter a single scanline of n bytes into out, returning the filter type
+uint8_t png_filter_row(const uint8_t *row,
+                       const uint8_t *prior,
+                       std::size_t n,
+                       std::size_t bpp,
+                       PngOptions::Filter filter,
+                       uint8_t *candidates,
+                       uint8_t *out)
+{
+  switch (filter)
+  {
+    case PngOptions::None:
+      std::memcpy(out, row, n);
+      return 0;
+    case PngOptions::Sub:
+      Simd::png_sub(row, n, bpp, out);
+      return 1;
+    case PngOptions::Up:
+      Simd::png_up(row, prior, n, out);
+      return 2;
+    case PngOptions::Average:
+      Simd::png_average(row, prior, n, bpp, out);
+      return 3;
+    case PngOptions::Paeth:
+      Simd::png_paeth(row, prior, n, bpp, out);
+      return 4;
+    case PngOptions::Adaptive:
+    {
+      // Minimum sum of absolute differences, with ties going to the simpler filter
+      Simd::png_sub(row, n, bpp, candidates);
+      Simd::png_up(row, prior, n, candidates + n);
+      Simd::png_average(row, prior, n, bpp, candidates + 2 * n);
+      Simd::png_paeth(row, prior, n, bpp, candidates + 3 * n);
+
+      const uint8_t *best = row;
+      uint8_t type = 0;
+      std::size_t mincost = Simd::png_cost(row, n);
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        const std::size_t cost = Simd::png_cost(candidates + i * n, n);
+        if (cost < mincost)
+        {
+          mincost = cost;
+          best = candidates + i * n;
+          type = i + 1;
+        }
+      }
+      std::memcpy(out, best, n);
+      return type;
+    }
+  }
+  throw Fmi::Exception(BCP, "Unknown PNG filter")
+      .addParameter("filter", std::to_string(filter));
+}
+
+// Filter the true color or gray scanlines of rows in place. The scanlines are processed
+// last first so that the scanline above is still unfiltered. The prior scanline preceding
+// the first one is at the start of the scratch space, zeros for the first rows of the image.
+void png_filter(uint8_t *data,
+                int rows,
+                std::size_t rowbytes,
+                std::size_t bpp,
+                PngOptions::Filter filter,
+                std::vector<uint8_t> &scratch)
+{
+  try
+  {
+    const std::size_t n = rowbytes - 1;
+    uint8_t *prior = scratch.data();
+    uint8_t *candidates = prior + 2 * n;
+    uint8_t *out = candidates + 4 * n;
+
+    for (int i = rows - 1; i >= 0; i--)
+    {
+      uint8_t *scanline = data + i * rowbytes;
+      const uint8_t *above = (i > 0 ? scanline - rowbytes + 1 : prior);
+      const uint8_t type = png_filter_row(scanline + 1, above, n, bpp, filter, candidates, out);
+      scanline[0] = type;
+      std::memcpy(scanline + 1, out, n);
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Emit the PNG signature and the chunks preceding the image data
+void png_header(
+    int width, int height, const PngFormat &format, std::string &buffer)
+{
+  try
+  {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    buffer.append(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+    uint8_t ihdr[13];
+    ihdr[0] = (width >> 24) & 0xff;
+    ihdr[1] = (width >> 16) & 0xff;
+    ihdr[2] = (width >> 8) & 0xff;
+    ihdr[3] = width & 0xff;
+    ihdr[4] = (height >> 24) & 0xff;
+    ihdr[5] = (height >> 16) & 0xff;
+    ihdr[6] = (height >> 8) & 0xff;
+    ihdr[7] = height & 0xff;
+    ihdr[8] = format.bitdepth;    // bit depth
+    ihdr[9] = format.colortype;   // color type
+    ihdr[10] = 0;                 // compression: deflate
+    ihdr[11] = 0;                 // filter method: adaptive
+    ihdr[12] = 0;                 // interlace: none
+    png_chunk(buffer, "IHDR", ihdr, sizeof(ihdr));
+
+    if (format.palette())
+    {
+      png_chunk(buffer, "PLTE", format.plte, format.plte_size);
+      if (format.trns_size > 0)
+        png_chunk(buffer, "tRNS", format.trns, format.trns_size);
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Append the zlib stream header for a 32K window, with the level hint as zlib itself would
+// set it
+void zlib_header(int level, std::vector<uint8_t> &out, std::size_t &pos)
+{
+  out.resize(std::max(out.size(), pos + 2));
+  out[pos++] = 0x78;
+  out[pos++] = (level <= 1 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda);
+}
+
+// Append the zlib stream trailer
+void zlib_trailer(uLong adler, std::vector<uint8_t> &out, std::size_t &pos)
+{
+  out.resize(std::max(out.size(), pos + 4));
+  out[pos++] = (adler >> 24) & 0xff;
+  out[pos++] = (adler >> 16) & 0xff;
+  out[pos++] = (adler >> 8) & 0xff;
+  out[pos++] = adler & 0xff;
+}
+
+// Compress scanlines in parallel chunks, pigz style. Each chunk of rows is compressed
+// with zlib into raw deflate blocks, and all but the last chunk of the stream end with
+// a sync flush so that the next chunk starts on a byte boundary. Each chunk is primed
+// with the preceding 32 KB of data, of which dictsize bytes precede the data, so that
+// matches can reach over the chunk boundaries. The blocks are written to out starting
+// at pos, which is advanced. Returns the Adler-32 checksum of the data.
+uLong deflate_chunks(const uint8_t *data,
+                     std::size_t dictsize,
+                     std::size_t rowbytes,
+                     int rows,
+                     bool last,
+                     int level,
+                     int bands,
+                     std::vector<std::vector<uint8_t>> &chunks,
+                     std::vector<uint8_t> &out,
+                     std::size_t &pos)
+{
+  try
+  {
+    level = std::clamp(level, 1, 9);
+    bands = std::clamp(bands, 1, rows);
+
+    if (chunks.size() < static_cast<std::size_t>(bands))
+      chunks.resize(bands);
+    std::vector<uLong> checksums(bands, 0);
+    std::vector<std::size_t> sizes(bands, 0);
+    std::vector<std::size_t> lengths(bands, 0);
+
+    parallel_bands(rows,
+                   bands,
+                   [&](int band, int row1, int row2)
+                   {
+                     const std::size_t begin = row1 * rowbytes;
+                     const std::size_t end = row2 * rowbytes;
+                     const bool finish = (last && row2 == rows);
+
+                     z_stream zs;
+                     std::memset(&zs, 0, sizeof(zs));
+                     if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                       throw Fmi::Exception(BCP, "Failed to initialize zlib compression");
+
+                     // Room for the data and the sync flush marker
+                     auto &chunk = chunks[band];
+                     chunk.resize(deflateBound(&zs, end - begin) + 16);
+
+                     const std::size_t dict = std::min<std::size_t>(dictsize + begin, 32768);
+                     int status = Z_OK;
+                     if (dict > 0)
+                       status = deflateSetDictionary(
+                           &zs, data + begin - dict, static_cast<uInt>(dict));
+
+                     if (status == Z_OK)
+                     {
+                       zs.next_in = const_cast<Bytef *>(data + begin);
+                       zs.avail_in = static_cast<uInt>(end - begin);
+                       zs.next_out = chunk.data();
+                       zs.avail_out = static_cast<uInt>(chunk.size());
+                       status = deflate(&zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+                     }
+                     sizes[band] = zs.total_out;
+                     deflateEnd(&zs);
+
+                     if (status != (finish ? Z_STREAM_END : Z_OK) || zs.avail_in != 0 ||
+                         zs.avail_out == 0)
+                       throw Fmi::Exception(BCP, "zlib failed to compress PNG image data");
+
+                     checksums[band] = libdeflate_adler32(1, data + begin, end - begin);
+                     lengths[band] = end - begin;
+                   });
+
+    std::size_t total = 0;
+    for (int band = 0; band < bands; band++)
+      total += sizes[band];
+    out.resize(std::max(out.size(), pos + total));
+
+    uLong adler = checksums[0];
+    for (int band = 0; band < bands; band++)
+    {
+      std::memcpy(out.data() + pos, chunks[band].data(), sizes[band]);
+      pos += sizes[band];
+      if (band > 0)
+        adler = adler32_combine(adler, checksums[band], static_cast<z_off_t>(lengths[band]));
+    }
+    return adler;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Number of chunks to compress the given rows in
+int chunk_count(std::size_t rowbytes, int rows, const PngOptions &pngOptions)
+{
+  // Chunks smaller than this would mostly increase the size of the output
+  const int min_chunk_bytes = 128 * 1024;
+
+  return band_count(static_cast<int>(rowbytes),
+                    rows,
+                    worker_count(pngOptions.threads),
+                    min_chunk_bytes);
+}
+
+// Generate, compress and emit the image data band by band. Only one band of scanlines
+// and its compressed data are held in memory at a time, and each band is emitted as its
+// own IDAT chunk. The bands form a single zlib stream compressed as in parallel
+// compression, using as many chunks per band as the options allow. The raw, scratch,
+// chunks and idat buffers are scratch space whose capacity is reused between images.
+void write_png_bands(PixelRows &rows,
+                     const PngFormat &format,
+                     const PngOptions &pngOptions,
+                     std::string &raw_buffer,
+                     std::vector<uint8_t> &scratch,
+                     std::vector<std::vector<uint8_t>> &chunks,
+                     std::vector<uint8_t> &idat,
+                     std::string &buffer)
+{
+  try
+  {
+    // The last 32 KB of the previous band are kept in front of the next
+    // one as the dictionary for matches over the band boundary
+    const std::size_t window = 32768;
+
+    const int height = rows.height();
+    const std::size_t rowbytes = format.rowbytes(rows.width());
+    const int bandrows = static_cast<int>(std::clamp<std::size_t>(
+        pngOptions.bandsize / rowbytes, 1, static_cast<std::size_t>(height)));
+    const int level = libdeflate_level();
+
+    raw_buffer.resize(window + bandrows * rowbytes);
+    auto *raw = reinterpret_cast<uint8_t *>(raw_buffer.data());
+    std::size_t dictsize = 0;
+
+    // The last unfiltered scanline of a band is the prior scanline of the next band
+    const bool filtered = (!format.palette() && pngOptions.filter != PngOptions::None);
+    if (filtered)
+      scratch.assign(png_filter_scratch(rowbytes), 0);
+
+    uLong adler = 1;
+    for (int row1 = 0; row1 < height; row1 += bandrows)
+    {
+      const int row2 = std::min(height, row1 + bandrows);
+      const int n = row2 - row1;
+      const bool last = (row2 == height);
+
+      png_scanlines(rows, format, row1, row2, raw + window);
+      if (filtered)
+      {
+        uint8_t *prior = scratch.data();
+        uint8_t *next_prior = prior + rowbytes - 1;
+        std::memcpy(next_prior, raw + window + (n - 1) * rowbytes + 1, rowbytes - 1);
+        png_filter(raw + window, n, rowbytes, format.bpp(), pngOptions.filter, scratch);
+        std::memcpy(prior, next_prior, rowbytes - 1);
+      }
+
+      std::size_t pos = 0;
+      if (row1 == 0)
+        zlib_header(level, idat, pos);
+      const auto checksum = deflate_chunks(raw + window,
+                                           dictsize,
+                                           rowbytes,
+                                           n,
+                                           last,
+                                           level,
+                                           chunk_count(rowbytes, n, pngOptions),
+                                           chunks,
+                                           idat,
+                                           pos);
+      adler = adler32_combine(adler, checksum, static_cast<z_off_t>(n * rowbytes));
+      if (last)
+        zlib_trailer(adler, idat, pos);
+
+      png_chunk(buffer, "IDAT", idat.data(), pos);
+
+      dictsize = std::min(window, dictsize + n * rowbytes);
+      std::memmove(raw + window - dictsize, raw + window + n * rowbytes - dictsize, dictsize);
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+void write_png_libpng(PixelRows &rows, const ColorMapper &mapper, std::string &buffer)
+{
+  try
+  {
+    const int width = rows.width();
+    const int height = rows.height();
+
+    // Allocate png info variables
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (png == nullptr)
+      throw Fmi::Exception(BCP, "Insufficient memory to allocate PNG write structure");
+
+    png_infop info = png_create_info_struct(png);
+    if (info == nullptr)
+    {
+      png_destroy_write_struct(&png, nullptr);
+      throw Fmi::Exception(BCP, "Insufficient memory to allocate PNG info structure");
+    }
+
+    // Closure for writing the raw data generated by libpng to the actual output string.
+
+    png_set_write_fn(png, &buffer, append_to_string, nullptr);
+
+    // Speed over size: no filtering, and compression level 3 avoids deflate_slow
+    // while still compressing reasonably well.
+
+    png_set_filter(png, 0, PNG_FILTER_NONE);
+    png_set_compression_level(png, 3);
+
+    // The palette colors ordered by descending use count. True colour mode is
+    // used if there are more than 256 colours.
+
+    const auto &palette = mapper.palette();
+
+    bool truecolor = (mapper.trueColor() || palette.size() > 256);
+
+    // Generate the PNG data to the output
+
+    if (truecolor)
+    {
+      png_set_IHDR(png,
+                   info,
+                   width,
+                   height,
+                   8,
+                   PNG_COLOR_TYPE_RGB_ALPHA,
+                   PNG_INTERLACE_NONE,
+                   PNG_COMPRESSION_TYPE_DEFAULT,
+                   PNG_FILTER_TYPE_DEFAULT);
+
+      png_write_info(png, info);
+      png_set_write_user_transform_fn(png, unpremultiply_data);
+
+      // libpng transforms a copy of each row, so the rows are not modified
+      for (int i = 0; i < height; i++)
+        png_write_row(png, reinterpret_cast<png_const_bytep>(rows.colors(i)));
+
+      png_write_end(png, info);
+      png_destroy_write_struct(&png, &info);
+    }
+
+    else
+    {
+      // Now we have to write palette data. This means we must take
+      // the original raw data, convert it into palette indices
+      // and write it to output. First we'll collect the necessary
+      // meta data, then we'll do the actual conversion to palette
+      // indices one row at a time.
+
+      // There are no more than 256 colours at this point. There is
+      // little point in allocating true size arrays on the heap,
+      // the sizes are so small. Hence fixed sizes.
+
+      // transparencies of non-opaque colours and the RGB values
+      png_byte transparent_values[256];  // NOLINT cannot use std::array here
+      png_color color_values[256];       // NOLINT cannot use std::array here
+
+      int num_transparent = 0;
+      int num_colors = 0;
+
+      // Collect the colours in the palette in use-count order. Since transparent
+      // colours are no longer guaranteed to come first, num_transparent may extend
+      // further into the palette than with the old alpha-ascending ordering. The
+      // tRNS table is still only as long as the highest-indexed transparent colour.
+
+      for (const Color color : palette)
+      {
+        // Inform libpng of the properties of the colour
+        auto a = static_cast<png_byte>(alpha(color));
+        color_values[num_colors].red =
+            unpremultiply_color_component(static_cast<png_byte>(red(color)), a);
+        color_values[num_colors].green =
+            unpremultiply_color_component(static_cast<png_byte>(green(color)), a);
+        color_values[num_colors].blue =
+            unpremultiply_color_component(static_cast<png_byte>(blue(color)), a);
+
+        // No need to skip storing here even if num_transparent increases no longer
+        transparent_values[num_colors] = a;
+
+        ++num_colors;
+
+        if (a < 255)
+          num_transparent = num_colors;
+      }
+
+      // Setup the libpng storing method
+      png_set_IHDR(png,
+                   info,
+                   width,
+                   height,
+                   8,
+                   PNG_COLOR_TYPE_PALETTE,
+                   PNG_INTERLACE_NONE,
+                   PNG_COMPRESSION_TYPE_DEFAULT,
+                   PNG_FILTER_TYPE_DEFAULT);
+
+      // This may be occasionally useful if some errors are encountered but
+      // you still want to see what the image would look like.
+      // png_set_benign_errors(png,1);
+
+      // Set transparencies, if there are any
+      if (num_transparent > 0)
+        png_set_tRNS(png, info, transparent_values, num_transparent, nullptr);
+
+      // Set the opaque RGB palette
+      png_set_PLTE(png, info, color_values, num_colors);
+
+      // Write PNG raw data
+
+      png_write_info(png, info);
+
+      // Write the palette indices row by row
+      for (int i = 0; i < height; i++)
+        png_write_row(png, rows.indices(i));
+
+      // Write PNG tail, deallocate memory
+      png_write_end(png, info);
+      png_destroy_write_struct(&png, &info);
+    }
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*
+ * Uniform images
+ *
+ * Empty and single color tiles are common, and are written without the
+ * color reduction. The same few tile sizes and colors repeat, so the
+ * encoded data is cached.
+ */
+// ----------------------------------------------------------------------
+
+// True if all pixels of the image have the same color, which is returned
+bool uniform_color(cairo_surface_t *image, Color &color)
+{
+  try
+  {
+    cairo_surface_flush(image);
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      return false;
+
+    const unsigned char *data = cairo_image_surface_get_data(image);
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    if (data == nullptr || width <= 0 || height <= 0)
+      return false;
+
+    color = *reinterpret_cast<const Color *>(data);
+    for (int j = 0; j < height; j++)
+    {
+      const auto *row =
+          reinterpret_cast<const Color *>(data + static_cast<std::size_t>(j) * stride);
+      if (Simd::color_run(row, width, color) != static_cast<std::size_t>(width))
+        return false;
+    }
+    return true;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Append the bytes of a value to a cache key
+template <typename T>
+void append_key(std::string &key, const T &value)
+{
+  key.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// OutputCache key of an image: the format, a hash of the pixels, the size and the color
+// reduction options. Returns an empty key if the image cannot be encoded.
+std::string image_key(cairo_surface_t *image, char format, const ColorMapOptions &options)
+{
+  try
+  {
+    cairo_surface_flush(image);
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      return {};
+
+    const unsigned char *data = cairo_image_surface_get_data(image);
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    if (data == nullptr || width <= 0 || height <= 0)
+      return {};
+
+    uint64_t hash[2];
+    Simd::hash_rows(data, 4 * static_cast<std::size_t>(width), height, stride, hash);
+
+    // The number of threads does not affect the color reduction
+    std::string key(1, format);
+    append_key(key, hash);
+    append_key(key, width);
+    append_key(key, height);
+    append_key(key, options.quality);
+    append_key(key, options.errorfactor);
+    append_key(key, options.maxcolors);
+    append_key(key, options.estimatequality);
+    append_key(key, options.truecolor);
+    append_key(key, options.twophase);
+    append_key(key, options.reusecoverage);
+    if (options.palette)
+    {
+      const auto &colors = options.palette->colors();
+      append_key(key, colors.size());
+      key.append(reinterpret_cast<const char *>(colors.data()), colors.size() * sizeof(Color));
+    }
+    return key;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// topng and topng_preserve produce the same output and share the keys
+std::string png_key(cairo_surface_t *image,
+                    const ColorMapOptions &options,
+                    const PngOptions &pngOptions)
+{
+  try
+  {
+    std::string key = image_key(image, 'P', options);
+    if (!key.empty())
+    {
+      append_key(key, libdeflate_level());
+      append_key(key, pngOptions.threads);
+      append_key(key, pngOptions.parallelsize);
+      append_key(key, pngOptions.bandsize);
+      append_key(key, pngOptions.filter);
+    }
+    return key;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+std::string webp_key(cairo_surface_t *image,
+                     const ColorMapOptions &options,
+                     const WebpOptions &webpOptions)
+{
+  try
+  {
+    std::string key = image_key(image, 'W', options);
+    if (!key.empty())
+      append_key(key, webpOptions.level);
+    return key;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Encoded data shared by all encoders. The cache is emptied when it grows too large.
+class UniformCache
+{
+ public:
+  using Key = std::tuple<int, int, int, Color>;  // width, height, compression level, color
+
+  bool find(const Key &key, std::string &value) const
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    auto pos = itsItems.find(key);
+    if (pos == itsItems.end())
+      return false;
+    value = pos->second;
+    return true;
+  }
+
+  void insert(const Key &key, const std::string &value)
+  {
+    const std::size_t max_size = 64;
+    std::lock_guard<std::mutex> lock(itsMutex);
+    if (itsItems.size() >= max_size)
+      itsItems.clear();
+    itsItems[key] = value;
+  }
+
+ private:
+  mutable std::mutex itsMutex;
+  std::map<Key, std::string> itsItems;
+};
+
+// Compressed image data of uniform PNGs, which depends only on the size and the level
+UniformCache &png_templates()
+{
+  static UniformCache cache;
+  return cache;
+}
+
+// Complete uniform WebP images
+UniformCache &webp_images()
+{
+  static UniformCache cache;
+  return cache;
+}
+
+// Write a single color image as a 1-bit palette PNG, exactly as the regular path would
+// write it. Returns false without writing anything if the regular path would use libpng
+// or split the image data into bands or parallel chunks.
+bool write_png_uniform(cairo_surface_t *image,
+                       Color color,
+                       const PngOptions &pngOptions,
+                       std::string &buffer)
+{
+  try
+  {
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int level = libdeflate_level();
+
+    PngFormat format;
+    png_palette(&color, 1, format);
+
+    const std::size_t rowbytes = format.rowbytes(width);
+    const std::size_t size = rowbytes * height;
+    if (std::getenv("GIZA_USE_LIBPNG") != nullptr || size > pngOptions.bandsize ||
+        (size > pngOptions.parallelsize && chunk_count(rowbytes, height, pngOptions) > 1))
+      return false;
+
+    // All the palette indices and hence all the scanline bytes are zero
+    const UniformCache::Key key{width, height, level, 0};
+    std::string idat;
+    if (!png_templates().find(key, idat))
+    {
+      const std::string raw(size, '\0');
+      auto *compressor = libdeflate_alloc_compressor(level);
+      if (compressor == nullptr)
+        throw Fmi::Exception(BCP, "Failed to allocate libdeflate compressor");
+      idat.resize(libdeflate_zlib_compress_bound(compressor, raw.size()));
+      const std::size_t size =
+          libdeflate_zlib_compress(compressor, raw.data(), raw.size(), idat.data(), idat.size());
+      libdeflate_free_compressor(compressor);
+      if (size == 0)
+        throw Fmi::Exception(BCP, "libdeflate failed to compress PNG image data");
+      idat.resize(size);
+      png_templates().insert(key, idat);
+    }
+
+    png_header(width, height, format, buffer);
+    png_chunk(buffer, "IDAT", reinterpret_cast<const uint8_t *>(idat.data()), idat.size());
+    png_chunk(buffer, "IEND", nullptr, 0);
+    return true;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// Write a single color image as WebP, using the cached result when available
+void write_webp_uniform(cairo_surface_t *image,
+                        Color color,
+                        const WebpOptions &options,
+                        std::string &buffer)
+{
+  try
+  {
+    const UniformCache::Key key{cairo_image_surface_get_width(image),
+                                cairo_image_surface_get_height(image),
+                                options.level,
+                                color};
+    if (webp_images().find(key, buffer))
+      return;
+
+    giza_surface_write_to_webp_string(image, buffer, options);
+    webp_images().insert(key, buffer);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Release the compressor
+ */
+// ----------------------------------------------------------------------
+
+Encoder::~Encoder()
+{
+  if (itsCompressor != nullptr)
+    libdeflate_free_compressor(itsCompressor);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The libdeflate compressor for the current compression level
+ */
+// ----------------------------------------------------------------------
+
+libdeflate_compressor *Encoder::compressor()
+{
+  try
+  {
+    const int level = libdeflate_level();
+    if (itsCompressor != nullptr && itsLevel == level)
+      return itsCompressor;
+
+    if (itsCompressor != nullptr)
+      libdeflate_free_compressor(itsCompressor);
+
+    itsCompressor = libdeflate_alloc_compressor(level);
+    if (itsCompressor == nullptr)
+      throw Fmi::Exception(BCP, "Failed to allocate libdeflate compressor");
+    itsLevel = level;
+
+    return itsCompressor;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compress the scanlines in itsRaw into itsIdat, returning the size
+ *
+ * Large images are compressed in parallel chunks if so requested, smaller
+ * ones in one piece with libdeflate.
+ */
+// ----------------------------------------------------------------------
+
+std::size_t Encoder::compress(int height, const PngOptions &pngOptions)
+{
+  try
+  {
+    if (itsRaw.size() > pngOptions.parallelsize)
+    {
+      const std::size_t rowbytes = itsRaw.size() / height;
+      const int bands = chunk_count(rowbytes, height, pngOptions);
+      if (bands > 1)
+      {
+        const int level = libdeflate_level();
+        std::size_t pos = 0;
+        zlib_header(level, itsIdat, pos);
+        const auto adler = deflate_chunks(reinterpret_cast<const uint8_t *>(itsRaw.data()),
+                                          0,
+                                          rowbytes,
+                                          height,
+                                          true,
+                                          level,
+                                          bands,
+                                          itsChunks,
+                                          itsIdat,
+                                          pos);
+        zlib_trailer(adler, itsIdat, pos);
+        return pos;
+      }
+    }
+
+    auto *zc = compressor();
+    const std::size_t bound = libdeflate_zlib_compress_bound(zc, itsRaw.size());
+    itsIdat.resize(bound);
+    const std::size_t size =
+        libdeflate_zlib_compress(zc, itsRaw.data(), itsRaw.size(), itsIdat.data(), bound);
+    if (size == 0)
+      throw Fmi::Exception(BCP, "libdeflate failed to compress PNG image data");
+    return size;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the image as PNG after the color map has been calculated
+ *
+ * Uses the libdeflate-based writer by default; set GIZA_USE_LIBPNG to fall
+ * back to the original libpng path (kept for comparison/safety while the
+ * libdeflate writer is being validated).
+ *
+ * In fused mode the color map is applied row by row while writing, either
+ * to the original colors or to colors already reduced with the same map.
+ */
+// ----------------------------------------------------------------------
+
+void Encoder::writepng(cairo_surface_t *image,
+                       const ColorMapper &mapper,
+                       bool fused,
+                       const PngOptions &pngOptions,
+                       std::string &buffer)
+{
+  try
+  {
+    PixelRows rows(image, mapper, fused);
+    if (std::getenv("GIZA_USE_LIBPNG") != nullptr)
+    {
+      write_png_libpng(rows, mapper, buffer);
+      return;
+    }
+
+    const int height = rows.height();
+    PngFormat format;
+    png_format(mapper, format);
+    const std::size_t rowbytes = format.rowbytes(rows.width());
+
+    png_header(rows.width(), height, format, buffer);
+
+    if (rowbytes * height > pngOptions.bandsize)
+      write_png_bands(
+          rows, format, pngOptions, itsRaw, itsScratch, itsChunks, itsIdat, buffer);
+    else
+    {
+      itsRaw.resize(rowbytes * height);
+      auto *raw = reinterpret_cast<uint8_t *>(itsRaw.data());
+      png_scanlines(rows, format, 0, height, raw);
+      if (!format.palette() && pngOptions.filter != PngOptions::None)
+      {
+        itsScratch.assign(png_filter_scratch(rowbytes), 0);
+        png_filter(raw, height, rowbytes, format.bpp(), pngOptions.filter, itsScratch);
+      }
+      const std::size_t size = compress(height, pngOptions);
+      png_chunk(buffer, "IDAT", itsIdat.data(), size);
+    }
+
+    png_chunk(buffer, "IEND", nullptr, 0);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a PNG string
+ *
+ * Single color images are written directly as 1-bit palette images,
+ * unless the image data would be written in bands or parallel chunks.
+ * When the OutputCache is enabled, an image found from it is returned
+ * without reducing its colors.
+ *
+ * The palette indices of an image larger than the band size would alone
+ * need as much memory as the bands save, so the indices of the reduced
+ * rows are then looked up band by band while writing.
+ */
+// ----------------------------------------------------------------------
+
+void Encoder::topng(cairo_surface_t *image,
+                    const ColorMapOptions &options,
+                    const PngOptions &pngOptions,
+                    std::string &buffer)
+{
+  try
+  {
+    buffer.clear();
+
+    Color color = 0;
+    if (!options.truecolor && !options.palette && uniform_color(image, color) &&
+        write_png_uniform(image, color, pngOptions, buffer))
+      return;
+
+    auto &cache = OutputCache::instance();
+    const std::string key = (cache.enabled() ? png_key(image, options, pngOptions) : "");
+    if (!key.empty() && cache.find(key, buffer))
+      return;
+
+    const std::size_t pixels = static_cast<std::size_t>(cairo_image_surface_get_width(image)) *
+                               cairo_image_surface_get_height(image);
+    const bool fused = (pixels > pngOptions.bandsize);
+
+    itsMapper.options(options);
+    itsMapper.indices(!fused);
+    itsMapper.reduce(image);
+
+    writepng(image, itsMapper, fused, pngOptions, buffer);
+
+    if (!key.empty())
+      cache.insert(key, buffer);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+std::string Encoder::topng(cairo_surface_t *image,
+                           const ColorMapOptions &options,
+                           const PngOptions &pngOptions)
+{
+  try
+  {
+    std::string buffer;
+    topng(image, options, pngOptions, buffer);
+    return buffer;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a PNG string without modifying it
+ *
+ * The colors are reduced on the fly while the scanlines are generated,
+ * so the image can still be encoded in other formats afterwards.
+ */
+// ----------------------------------------------------------------------
+
+void Encoder::topng_preserve(cairo_surface_t *image,
+                             const ColorMapOptions &options,
+                             const PngOptions &pngOptions,
+                             std::string &buffer)
+{
+  try
+  {
+    buffer.clear();
+
+    Color color = 0;
+    if (!options.truecolor && !options.palette && uniform_color(image, color) &&
+        write_png_uniform(image, color, pngOptions, buffer))
+      return;
+
+    auto &cache = OutputCache::instance();
+    const std::string key = (cache.enabled() ? png_key(image, options, pngOptions) : "");
+    if (!key.empty() && cache.find(key, buffer))
+      return;
+
+    itsMapper.options(options);
+    itsMapper.analyze(image);
+
+    writepng(image, itsMapper, true, pngOptions, buffer);
+
+    if (!key.empty())
+      cache.insert(key, buffer);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+std::string Encoder::topng_preserve(cairo_surface_t *image,
+                                    const ColorMapOptions &options,
+                                    const PngOptions &pngOptions)
+{
+  try
+  {
+    std::string buffer;
+    topng_preserve(image, options, pngOptions, buffer);
+    return buffer;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a PNG string using the colors of another image
+ *
+ * The mapper must have analyzed an image which contains all the colors
+ * of this one, typically a larger image of which this one is a part.
+ * Neither the image nor the mapper is modified, so several encoders may
+ * share the mapper.
+ */
+// ----------------------------------------------------------------------
+
+void Encoder::topng_mapped(cairo_surface_t *image,
+                           const ColorMapper &mapper,
+                           const PngOptions &pngOptions,
+                           std::string &buffer)
+{
+  try
+  {
+    buffer.clear();
+    writepng(image, mapper, true, pngOptions, buffer);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a WEBP string
+ */
+// ----------------------------------------------------------------------
+
+void Encoder::towebp(cairo_surface_t *image,
+                     const ColorMapOptions &options,
+                     const WebpOptions &webpOptions,
+                     std::string &buffer)
+{
+  try
+  {
+    buffer.clear();
+
+    // A single color is mapped to itself, the image need not be reduced
+    Color color = 0;
+    if (!options.truecolor && !options.palette && uniform_color(image, color))
+    {
+      write_webp_uniform(image, color, webpOptions, buffer);
+      return;
+    }
+
+    auto &cache = OutputCache::instance();
+    const std::string key = (cache.enabled() ? webp_key(image, options, webpOptions) : "");
+    if (!key.empty() && cache.find(key, buffer))
+      return;
+
+    itsMapper.options(options);
+    itsMapper.indices(false);
+    itsMapper.reduce(image);
+
+    giza_surface_write_to_webp_string(image, buffer, webpOptions);
+
+    if (!key.empty())
+      cache.insert(key, buffer);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+std::string Encoder::towebp(cairo_surface_t *image,
+                            const ColorMapOptions &options,
+                            const WebpOptions &webpOptions)
+{
+  try
+  {
+    std::string buffer;
+    towebp(image, options, webpOptions, buffer);
+    return buffer;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surfaces to an animated WEBP string
+ */
+// ----------------------------------------------------------------------
+
+std::string Encoder::towebpanim(const std::vector<cairo_surface_t *> &frames,
+                                const std::vector<int> &durations,
+                                int loop_count,
+                                const ColorMapOptions &options,
+                                const WebpOptions &webpOptions)
+{
+  try
+  {
+    if (frames.empty())
+      throw Fmi::Exception(BCP, "Giza::towebpanim requires at least one frame");
+
+    if (durations.size() != frames.size())
+      throw Fmi::Exception(BCP, "Giza::towebpanim requires one duration for each frame");
+
+    int width = cairo_image_surface_get_width(frames[0]);
+    int height = cairo_image_surface_get_height(frames[0]);
+
+    WebPConfig config;
+    if (!WebPConfigInit(&config))
+      throw Fmi::Exception(BCP, "Failed to initialize libwebp configuration");
+    config.lossless = 1;
+    if (webpOptions.level >= 0)
+      if (!WebPConfigLosslessPreset(&config, std::clamp(webpOptions.level, 0, 9)))
+        throw Fmi::Exception(BCP, "Invalid libwebp lossless preset level");
+    if (!WebPValidateConfig(&config))
+      throw Fmi::Exception(BCP, "Invalid libwebp configuration");
+
+    WebPAnimEncoderOptions enc_options;
+    if (!WebPAnimEncoderOptionsInit(&enc_options))
+      throw Fmi::Exception(BCP, "Failed to initialize libwebp animation encoder options");
+    enc_options.anim_params.loop_count = std::max(0, loop_count);
+
+    WebPAnimEncoder *enc = WebPAnimEncoderNew(width, height, &enc_options);
+    if (enc == nullptr)
+      throw Fmi::Exception(BCP, "Failed to create libwebp animation encoder");
+
+    std::string buffer;
+    try
+    {
+      int timestamp = 0;
+      for (std::size_t i = 0; i < frames.size(); i++)
+      {
+        auto *image = frames[i];
+
+        if (cairo_image_surface_get_width(image) != width ||
+            cairo_image_surface_get_height(image) != height)
+          throw Fmi::Exception(BCP, "Giza::towebpanim frames must be of equal size");
+
+        itsMapper.options(options);
+        itsMapper.indices(false);
+        itsMapper.reduce(image);
+
+        // The encoder copies the frame, so the picture may refer to the surface
+        WebPPicture pic;
+        if (!WebPPictureInit(&pic))
+          throw Fmi::Exception(BCP, "Failed to initialize libwebp picture");
+        surface_to_webp_picture(image, pic);
+
+        bool ok = WebPAnimEncoderAdd(enc, &pic, timestamp, &config);
+        WebPPictureFree(&pic);
+
+        if (!ok)
+          throw Fmi::Exception(BCP, "libwebp animation encoding failed")
+              .addParameter("error", WebPAnimEncoderGetError(enc));
+
+        timestamp += durations[i];
+      }
+
+      // Flush the encoder with the total duration as the final timestamp
+
+      if (!WebPAnimEncoderAdd(enc, nullptr, timestamp, nullptr))
+        throw Fmi::Exception(BCP, "Failed to flush libwebp animation encoder")
+            .addParameter("error", WebPAnimEncoderGetError(enc));
+
+      WebPData webp_data;
+      WebPDataInit(&webp_data);
+      if (!WebPAnimEncoderAssemble(enc, &webp_data))
+      {
+        WebPDataClear(&webp_data);
+        throw Fmi::Exception(BCP, "Failed to assemble libwebp animation")
+            .addParameter("error", WebPAnimEncoderGetError(enc));
+      }
+
+      buffer.assign(reinterpret_cast<const char *>(webp_data.bytes), webp_data.size);
+      WebPDataClear(&webp_data);
+    }
+    catch (...)
+    {
+      WebPAnimEncoderDelete(enc);
+      throw;
+    }
+
+    WebPAnimEncoderDelete(enc);
+    return buffer;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Giza
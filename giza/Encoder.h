@@ -0,0 +1,94 @@
+#pragma once
+
+#include "ColorMapper.h"
+#include <cairo/cairo.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct libdeflate_compressor;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Image encoder which keeps its buffers from one image to the next
+ *
+ * The Giza::topng etc functions use a new encoder for each image. Servers
+ * encoding many images should rather keep an encoder per thread, so that
+ * the color reduction tables, the scanline buffers and the compressor are
+ * reused and steady state encoding allocates very little memory. The
+ * buffers grow to fit the largest image encoded so far.
+ *
+ * An encoder may not be used by several threads simultaneously.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+struct PngOptions;
+struct WebpOptions;
+
+class Encoder
+{
+ public:
+  Encoder() = default;
+  ~Encoder();
+  Encoder(const Encoder& other) = delete;
+  Encoder& operator=(const Encoder& other) = delete;
+
+  std::string topng(cairo_surface_t* image,
+                    const ColorMapOptions& options,
+                    const PngOptions& pngOptions);
+  std::string topng_preserve(cairo_surface_t* image,
+                             const ColorMapOptions& options,
+                             const PngOptions& pngOptions);
+  std::string towebp(cairo_surface_t* image,
+                     const ColorMapOptions& options,
+                     const WebpOptions& webpOptions);
+  std::string towebpanim(const std::vector<cairo_surface_t*>& frames,
+                         const std::vector<int>& durations,
+                         int loop_count,
+                         const ColorMapOptions& options,
+                         const WebpOptions& webpOptions);
+
+  // Replace the contents of the given buffer, reusing its capacity
+  void topng(cairo_surface_t* image,
+             const ColorMapOptions& options,
+             const PngOptions& pngOptions,
+             std::string& buffer);
+  void topng_preserve(cairo_surface_t* image,
+                      const ColorMapOptions& options,
+                      const PngOptions& pngOptions,
+                      std::string& buffer);
+  void towebp(cairo_surface_t* image,
+              const ColorMapOptions& options,
+              const WebpOptions& webpOptions,
+              std::string& buffer);
+
+  // Encode with the color map of a mapper which has analyzed a larger image
+  // containing this one, for example when cutting the larger image into tiles
+  void topng_mapped(cairo_surface_t* image,
+                    const ColorMapper& mapper,
+                    const PngOptions& pngOptions,
+                    std::string& buffer);
+
+ private:
+  void writepng(cairo_surface_t* image,
+                const ColorMapper& mapper,
+                bool fused,
+                const PngOptions& pngOptions,
+                std::string& buffer);
+  std::size_t compress(int height, const PngOptions& pngOptions);
+  libdeflate_compressor* compressor();
+
+  ColorMapper itsMapper;
+  libdeflate_compressor* itsCompressor = nullptr;
+  int itsLevel = 0;                                  // compression level of itsCompressor
+  std::string itsRaw;                                // PNG scanlines, or a band of them
+  std::vector<std::uint8_t> itsIdat;                 // compressed PNG scanlines
+  std::vector<std::uint8_t> itsScratch;              // scanline filtering scratch space
+  std::vector<std::vector<std::uint8_t>> itsChunks;  // parallel compression output
+
+};  // class Encoder
+
+}  // namespace Giza
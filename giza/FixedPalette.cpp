@@ -0,0 +1,57 @@
+#include "FixedPalette.h"
+#include <macgyver/Exception.h>
+#include <algorithm>
+#include <string>
+
+namespace Giza
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the search tree of the palette
+ */
+// ----------------------------------------------------------------------
+
+FixedPalette::FixedPalette(const std::vector<Color>& colors) : itsColors(colors)
+{
+  try
+  {
+    if (itsColors.empty() || itsColors.size() > 256)
+      throw Fmi::Exception(BCP, "A fixed palette must have 1-256 colors")
+          .addParameter("Colors", std::to_string(itsColors.size()));
+
+    std::vector<Color> sorted = itsColors;
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+      throw Fmi::Exception(BCP, "The colors of a fixed palette must be distinct");
+
+    for (auto color : itsColors)
+      itsTree.insert(color);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest palette colors
+ *
+ * The tree is not modified, so several threads may search it at once.
+ */
+// ----------------------------------------------------------------------
+
+void FixedPalette::nearest(const Color* colors, std::size_t n, Color* nearest) const
+{
+  try
+  {
+    std::vector<double> distances(n);
+    itsTree.nearest(colors, n, nearest, distances.data());
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Giza
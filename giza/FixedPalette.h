@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ColorTree.h"
+#include "ColorTypes.h"
+#include <cstddef>
+#include <vector>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A palette chosen by the caller instead of the color reduction
+ *
+ * Products with a known legend, and tile sets which need the same palette
+ * in every tile, map the colors of each image to their nearest palette
+ * colors. The palette and its search tree are built once and may then be
+ * used by any number of threads simultaneously, for example via a
+ * shared ColorMapOptions::palette.
+ *
+ * The colors are premultiplied ARGB like the pixels of Cairo images.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+class FixedPalette
+{
+ public:
+  // At most 256 distinct colors in palette index order
+  explicit FixedPalette(const std::vector<Color>& colors);
+  FixedPalette(const FixedPalette& other) = delete;
+  FixedPalette& operator=(const FixedPalette& other) = delete;
+
+  const std::vector<Color>& colors() const { return itsColors; }
+  std::size_t size() const { return itsColors.size(); }
+
+  // Nearest palette colors of n colors
+  void nearest(const Color* colors, std::size_t n, Color* nearest) const;
+
+ private:
+  std::vector<Color> itsColors;
+  ColorTree itsTree;
+
+};  // class FixedPalette
+}  // namespace Giza
@@ -1,231 +1,22 @@
 #include "Giza.h"
+#include "ColorMapOptions.h"
 #include "ColorMapper.h"
+#include "Encoder.h"
+#include "Parallel.h"
+#include "PngOptions.h"
+#include "Simd.h"
 #include "WebpOptions.h"
 #include <cairo/cairo.h>
 #include <macgyver/Exception.h>
-#include <webp/encode.h>
-#include <webp/mux.h>
 #include <algorithm>
 #include <cstdint>
-#include <cstdlib>
 #include <cstring>
-#include <libdeflate.h>
-#include <map>
-#include <png.h>
-#include <vector>
+#include <unordered_map>
 
 namespace Giza
 {
 namespace
 {
-/* Unpremultiply a single colour component */
-
-png_byte unpremultiply_color_component(png_byte component, png_byte alpha)
-{
-  try
-  {
-    if (alpha == 0)
-      return 0;
-
-    return (component * 255 + alpha / 2) / alpha;
-  }
-  catch (...)
-  {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!");
-  }
-}
-
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
-void unpremultiply_data(png_structp /* png */, png_row_infop row_info, png_bytep data)
-{
-  try
-  {
-    unsigned int i;
-
-    for (i = 0; i < row_info->rowbytes; i += 4)
-    {
-      uint8_t *b = &data[i];
-      uint32_t pixel;
-      uint8_t alpha;
-
-      memcpy(&pixel, b, sizeof(uint32_t));
-      alpha = (pixel & 0xff000000U) >> 24;
-      if (alpha == 0)
-      {
-        b[0] = b[1] = b[2] = b[3] = 0;  // normalize fully transparent colours
-      }
-      else
-      {
-        b[0] = (((pixel & 0xff0000U) >> 16) * 255 + alpha / 2) / alpha;
-        b[1] = (((pixel & 0x00ff00U) >> 8) * 255 + alpha / 2) / alpha;
-        b[2] = (((pixel & 0x0000ffU) >> 0) * 255 + alpha / 2) / alpha;
-        b[3] = alpha;
-      }
-    }
-  }
-  catch (...)
-  {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!");
-  }
-}
-
-// Cairo callback for writing image chunks
-
-void append_to_string(png_structp png, png_bytep data, png_size_t length)
-{
-  try
-  {
-    auto *buffer = reinterpret_cast<std::string *>(png_get_io_ptr(png));
-    buffer->append(reinterpret_cast<const char *>(data), length);
-  }
-  catch (...)
-  {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!");
-  }
-}
-
-// Convert premultiplied ARGB32 surface data in place to unpremultiplied RGBA
-// byte order as expected by libwebp, and return the pixel data pointer.
-
-unsigned char *surface_to_unpremultiplied_rgba(cairo_surface_t *image,
-                                               int &width,
-                                               int &height,
-                                               int &stride)
-{
-  try
-  {
-    cairo_surface_flush(image);
-
-    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
-      throw Fmi::Exception(BCP, "Giza::towebp can write only Cairo ARGB32 format images");
-
-    // Access image data directly.
-    unsigned char *data = cairo_image_surface_get_data(image);
-
-    if (data == nullptr)
-      throw Fmi::Exception(BCP, "Attempt to render an invalid Cairo image as WEBP");
-
-    // The cairo image data may have a stride width, meaning once you have
-    // passed a certain width you may have to skip more bytes to reach the next
-    // row. Hence the position of the next row is calculated using the stride,
-    // and not the width.
-
-    width = cairo_image_surface_get_width(image);
-    height = cairo_image_surface_get_height(image);
-    stride = cairo_image_surface_get_stride(image);
-
-    // Converting ARGB32 and unpremultiplying by alpha
-
-    for (int i = 0; i < height; i++)
-    {
-      uint *row = (uint *)(data + i * stride);
-      for (int x = 0; x < width; x++)
-      {
-        uint col = row[x];
-        uint8_t alpha = (col & 0xff000000U) >> 24;
-        if (alpha == 0)
-          row[x] = 0;  // normalize fully transparent colours
-        else
-        {
-          uint8_t r = (((col & 0xff0000U) >> 16) * 255 + alpha / 2) / alpha;
-          uint8_t g = (((col & 0x00ff00U) >> 8) * 255 + alpha / 2) / alpha;
-          uint8_t b = (((col & 0x0000ffU) >> 0) * 255 + alpha / 2) / alpha;
-          row[x] = (alpha << 24) | (b << 16) | (g << 8) | r;
-        }
-      }
-    }
-
-    return data;
-  }
-  catch (...)
-  {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!");
-  }
-}
-
-void giza_surface_write_to_webp_string(cairo_surface_t *image,
-                                       std::string &buffer,
-                                       const WebpOptions &options)
-{
-  try
-  {
-    int width = 0;
-    int height = 0;
-    int stride = 0;
-    unsigned char *data = surface_to_unpremultiplied_rgba(image, width, height, stride);
-
-    if (options.level < 0)
-    {
-      // Default: use libwebp's simple lossless API (historical behaviour)
-      uint8_t *output = nullptr;
-      size_t sz = WebPEncodeLosslessRGBA(data, width, height, stride, &output);
-
-      try
-      {
-        if (sz && output)
-          buffer.append(reinterpret_cast<const char *>(output), sz);
-      }
-      catch (...)
-      {
-      }
-
-      free(output);
-    }
-    else
-    {
-      // Explicit speed control: use the advanced API so the lossless preset
-      // level (0 = fastest/largest ... 9 = slowest/smallest) takes effect.
-      WebPConfig config;
-      if (!WebPConfigInit(&config))
-        throw Fmi::Exception(BCP, "Failed to initialize libwebp configuration");
-      config.lossless = 1;
-      if (!WebPConfigLosslessPreset(&config, std::clamp(options.level, 0, 9)))
-        throw Fmi::Exception(BCP, "Invalid libwebp lossless preset level");
-      if (!WebPValidateConfig(&config))
-        throw Fmi::Exception(BCP, "Invalid libwebp configuration");
-
-      WebPPicture pic;
-      if (!WebPPictureInit(&pic))
-        throw Fmi::Exception(BCP, "Failed to initialize libwebp picture");
-      pic.use_argb = 1;
-      pic.width = width;
-      pic.height = height;
-
-      WebPMemoryWriter writer;
-      WebPMemoryWriterInit(&writer);
-      pic.writer = WebPMemoryWrite;
-      pic.custom_ptr = &writer;
-
-      try
-      {
-        // The pixel data is already in RGBA byte order (see the unpremultiply
-        // loop above), matching what WebPEncodeLosslessRGBA expects.
-        if (!WebPPictureImportRGBA(&pic, data, stride))
-          throw Fmi::Exception(BCP, "Failed to import image into libwebp picture");
-
-        if (!WebPEncode(&config, &pic))
-          throw Fmi::Exception(BCP, "libwebp encoding failed")
-              .addParameter("error_code", std::to_string(pic.error_code));
-
-        buffer.append(reinterpret_cast<const char *>(writer.mem), writer.size);
-      }
-      catch (...)
-      {
-        WebPMemoryWriterClear(&writer);
-        WebPPictureFree(&pic);
-        throw;
-      }
-
-      WebPMemoryWriterClear(&writer);
-      WebPPictureFree(&pic);
-    }
-  }
-  catch (...)
-  {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!");
-  }
-}
-
 uint *giza_surface_write_to_argb(cairo_surface_t *image)
 {
   try
@@ -281,182 +72,72 @@ uint *giza_surface_write_to_argb(cairo_surface_t *image)
   }
 }
 
-// --- Minimal PNG container writer compressing IDAT with libdeflate ---------------------
-//
-// giza always writes unfiltered scanlines (PNG_FILTER_NONE), so the IDAT input is simply a
-// 0x00 filter byte followed by the raw row bytes per row. PNG's IDAT payload is a zlib
-// datastream, which is exactly what libdeflate_zlib_compress() produces, and PNG chunk CRCs
-// are the standard CRC-32 that libdeflate_crc32() computes. This lets us bypass libpng (and
-// its streaming zlib) and use libdeflate's faster one-shot compressor.
-
-void put_be32(std::string &out, uint32_t value)
+// A rectangle of an image, which shares the pixels of the image
+struct Tile
 {
-  out.push_back(static_cast<char>((value >> 24) & 0xff));
-  out.push_back(static_cast<char>((value >> 16) & 0xff));
-  out.push_back(static_cast<char>((value >> 8) & 0xff));
-  out.push_back(static_cast<char>(value & 0xff));
-}
-
-// Append a PNG chunk: length, 4-byte type, data, CRC-32 over (type + data).
-void png_chunk(std::string &out, const char *type, const uint8_t *data, size_t len)
+  unsigned char *data = nullptr;
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+
+  bool operator==(const Tile &other) const
+  {
+    if (width != other.width || height != other.height)
+      return false;
+    for (int j = 0; j < height; j++)
+      if (std::memcmp(data + static_cast<std::size_t>(j) * stride,
+                      other.data + static_cast<std::size_t>(j) * other.stride,
+                      4 * static_cast<std::size_t>(width)) != 0)
+        return false;
+    return true;
+  }
+};
+
+// Hash of the size and the pixels of a tile
+std::string tile_key(const Tile &tile)
 {
-  put_be32(out, static_cast<uint32_t>(len));
-  const size_t crc_begin = out.size();
-  out.append(type, 4);
-  if (len > 0)
-    out.append(reinterpret_cast<const char *>(data), len);
-  const auto crc = libdeflate_crc32(0, out.data() + crc_begin, 4 + len);
-  put_be32(out, crc);
+  uint64_t hash[2];
+  const std::size_t rowbytes = 4 * static_cast<std::size_t>(tile.width);
+  Simd::hash_rows(tile.data, rowbytes, tile.height, tile.stride, hash);
+  std::string key(reinterpret_cast<const char *>(hash), sizeof(hash));
+  key.append(reinterpret_cast<const char *>(&tile.width), sizeof(tile.width));
+  key.append(reinterpret_cast<const char *>(&tile.height), sizeof(tile.height));
+  return key;
 }
 
-// libdeflate compression level (1..12). Default 1 favors speed (as the previous zlib level 3
-// did) while still producing slightly smaller output than zlib level 3, and is measurably
-// faster. Overridable via GIZA_PNG_LEVEL for benchmarking or when smaller files are preferred.
-int libdeflate_level()
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a WEBP string
+ */
+// ----------------------------------------------------------------------
+
+std::string towebp(cairo_surface_t *image)
 {
-  if (const char *env = std::getenv("GIZA_PNG_LEVEL"))
+  try
   {
-    const int level = std::atoi(env);
-    if (level >= 1 && level <= 12)
-      return level;
+    Encoder encoder;
+    return encoder.towebp(image, ColorMapOptions(), WebpOptions());
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
   }
-  return 1;
 }
 
-void write_png_libdeflate(cairo_surface_t *image, const ColorMapper &mapper, std::string &buffer)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a WEBP string
+ */
+// ----------------------------------------------------------------------
+
+std::string towebp(cairo_surface_t *image, const ColorMapOptions &options)
 {
   try
   {
-    cairo_surface_flush(image);
-
-    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
-      throw Fmi::Exception(BCP, "Giza::topng can write only Cairo ARGB32 format images");
-
-    unsigned char *data = cairo_image_surface_get_data(image);
-    if (data == nullptr)
-      throw Fmi::Exception(BCP, "Attempt to render an invalid Cairo image as PNG");
-
-    const int width = cairo_image_surface_get_width(image);
-    const int height = cairo_image_surface_get_height(image);
-    const int stride = cairo_image_surface_get_stride(image);
-
-    // Same truecolor-vs-palette decision as the libpng path. The palette colors
-    // are ordered by descending use count, which is also the palette index order.
-    const auto &palette = mapper.palette();
-    const bool truecolor = (mapper.trueColor() || palette.size() > 256);
-
-    // Build the raw (unfiltered) scanline buffer and, for palette mode, the palette tables.
-    std::string raw;
-    std::vector<uint8_t> plte;  // RGB triplets
-    std::vector<uint8_t> trns;  // leading transparent alphas
-
-    if (truecolor)
-    {
-      const size_t rowbytes = static_cast<size_t>(width) * 4;
-      raw.resize(static_cast<size_t>(height) * (1 + rowbytes));
-      auto *out = reinterpret_cast<uint8_t *>(raw.data());
-      for (int i = 0; i < height; i++)
-      {
-        const auto *row = data + static_cast<size_t>(i) * stride;
-        *out++ = 0;  // PNG_FILTER_NONE
-        for (int j = 0; j < width; j++)
-        {
-          uint32_t pixel;
-          std::memcpy(&pixel, row + j * 4, sizeof(pixel));
-          const uint8_t a = (pixel & 0xff000000U) >> 24;
-          if (a == 0)
-          {
-            out[0] = out[1] = out[2] = out[3] = 0;  // normalize fully transparent pixels
-          }
-          else
-          {
-            out[0] = (((pixel & 0xff0000U) >> 16) * 255 + a / 2) / a;
-            out[1] = (((pixel & 0x00ff00U) >> 8) * 255 + a / 2) / a;
-            out[2] = (((pixel & 0x0000ffU) >> 0) * 255 + a / 2) / a;
-            out[3] = a;
-          }
-          out += 4;
-        }
-      }
-    }
-    else
-    {
-      // Assign palette indices in use-count order (same as the libpng path). Note that
-      // transparent colors are no longer guaranteed to come first, so tRNS may extend
-      // further into the palette than with the old alpha-ascending ordering.
-      std::map<Color, int> color_indices;
-      int num_transparent = 0;
-      for (const Color color : palette)
-      {
-        const int idx = static_cast<int>(color_indices.size());
-        color_indices.insert(std::make_pair(color, idx));
-        const auto a = alpha(color);
-        plte.push_back(unpremultiply_color_component(red(color), a));
-        plte.push_back(unpremultiply_color_component(green(color), a));
-        plte.push_back(unpremultiply_color_component(blue(color), a));
-        trns.push_back(a);
-        if (a < 255)
-          num_transparent = idx + 1;
-      }
-      trns.resize(num_transparent);  // keep only the leading transparent entries
-
-      const size_t rowbytes = static_cast<size_t>(width);
-      raw.resize(static_cast<size_t>(height) * (1 + rowbytes));
-      auto *out = reinterpret_cast<uint8_t *>(raw.data());
-      for (int i = 0; i < height; i++)
-      {
-        const auto *row = data + static_cast<size_t>(i) * stride;
-        *out++ = 0;  // PNG_FILTER_NONE
-        for (int j = 0; j < width; j++)
-        {
-          Color c = *reinterpret_cast<const Color *>(row + j * 4);
-          *out++ = static_cast<uint8_t>(color_indices.at(c));
-        }
-      }
-    }
-
-    // Compress the scanlines into the IDAT zlib datastream
-    auto *compressor = libdeflate_alloc_compressor(libdeflate_level());
-    if (compressor == nullptr)
-      throw Fmi::Exception(BCP, "Failed to allocate libdeflate compressor");
-
-    const size_t bound = libdeflate_zlib_compress_bound(compressor, raw.size());
-    std::vector<uint8_t> idat(bound);
-    const size_t idat_size =
-        libdeflate_zlib_compress(compressor, raw.data(), raw.size(), idat.data(), bound);
-    libdeflate_free_compressor(compressor);
-    if (idat_size == 0)
-      throw Fmi::Exception(BCP, "libdeflate failed to compress PNG image data");
-
-    // Emit the PNG datastream
-    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
-    buffer.append(reinterpret_cast<const char *>(signature), sizeof(signature));
-
-    uint8_t ihdr[13];
-    ihdr[0] = (width >> 24) & 0xff;
-    ihdr[1] = (width >> 16) & 0xff;
-    ihdr[2] = (width >> 8) & 0xff;
-    ihdr[3] = width & 0xff;
-    ihdr[4] = (height >> 24) & 0xff;
-    ihdr[5] = (height >> 16) & 0xff;
-    ihdr[6] = (height >> 8) & 0xff;
-    ihdr[7] = height & 0xff;
-    ihdr[8] = 8;                  // bit depth
-    ihdr[9] = truecolor ? 6 : 3;  // color type: RGBA or palette
-    ihdr[10] = 0;                 // compression: deflate
-    ihdr[11] = 0;                 // filter method: adaptive (we only use NONE)
-    ihdr[12] = 0;                 // interlace: none
-    png_chunk(buffer, "IHDR", ihdr, sizeof(ihdr));
-
-    if (!truecolor)
-    {
-      png_chunk(buffer, "PLTE", plte.data(), plte.size());
-      if (!trns.empty())
-        png_chunk(buffer, "tRNS", trns.data(), trns.size());
-    }
-
-    png_chunk(buffer, "IDAT", idat.data(), idat_size);
-    png_chunk(buffer, "IEND", nullptr, 0);
+    Encoder encoder;
+    return encoder.towebp(image, options, WebpOptions());
   }
   catch (...)
   {
@@ -464,188 +145,20 @@ void write_png_libdeflate(cairo_surface_t *image, const ColorMapper &mapper, std
   }
 }
 
-void write_png_libpng(cairo_surface_t *image, const ColorMapper &mapper, std::string &buffer)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a WEBP string with explicit encoder options
+ */
+// ----------------------------------------------------------------------
+
+std::string towebp(cairo_surface_t *image,
+                   const ColorMapOptions &options,
+                   const WebpOptions &webpOptions)
 {
   try
   {
-    // Do pending operations
-    cairo_surface_flush(image);
-
-    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
-      throw Fmi::Exception(BCP, "Giza::topng can write only Cairo ARGB32 format images");
-
-    // Access image data directly.
-    unsigned char *data = cairo_image_surface_get_data(image);
-
-    if (data == nullptr)
-      throw Fmi::Exception(BCP, "Attempt to render an invalid Cairo image as PNG");
-
-    // The cairo image data may have a stride width, meaning once you have
-    // passed a certain width you may have to skip more bytes to reach the next
-    // row. Hence the position of the next row is calculated using the stride,
-    // and not the width.
-
-    int width = cairo_image_surface_get_width(image);
-    int height = cairo_image_surface_get_height(image);
-    int stride = cairo_image_surface_get_stride(image);
-
-    // Allocate png info variables
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    if (png == nullptr)
-      throw Fmi::Exception(BCP, "Insufficient memory to allocate PNG write structure");
-
-    png_infop info = png_create_info_struct(png);
-    if (info == nullptr)
-    {
-      png_destroy_write_struct(&png, nullptr);
-      throw Fmi::Exception(BCP, "Insufficient memory to allocate PNG info structure");
-    }
-
-    // Closure for writing the raw data generated by libpng to the actual output string.
-
-    png_set_write_fn(png, &buffer, append_to_string, nullptr);
-
-    // Speed over size: no filtering, and compression level 3 avoids deflate_slow
-    // while still compressing reasonably well.
-
-    png_set_filter(png, 0, PNG_FILTER_NONE);
-    png_set_compression_level(png, 3);
-
-    // The palette colors ordered by descending use count. True colour mode is
-    // used if there are more than 256 colours.
-
-    const auto &palette = mapper.palette();
-
-    bool truecolor = (mapper.trueColor() || palette.size() > 256);
-
-    // Generate the PNG data to the output
-
-    if (truecolor)
-    {
-      // In ARGB mode we can handle all rows simultaneously.
-      // Note that the pointers here are just pointers to
-      // the cairo raw data, and hence no deletions afterwards
-      // are necessary.
-
-      std::vector<png_byte *> rows(height, nullptr);
-      for (int i = 0; i < height; i++)
-        rows[i] = static_cast<png_byte *>(data + i * stride);
-
-      png_set_IHDR(png,
-                   info,
-                   width,
-                   height,
-                   8,
-                   PNG_COLOR_TYPE_RGB_ALPHA,
-                   PNG_INTERLACE_NONE,
-                   PNG_COMPRESSION_TYPE_DEFAULT,
-                   PNG_FILTER_TYPE_DEFAULT);
-
-      png_write_info(png, info);
-      png_set_write_user_transform_fn(png, unpremultiply_data);
-      png_write_image(png, rows.data());
-      png_write_end(png, info);
-      png_destroy_write_struct(&png, &info);
-    }
-
-    else
-    {
-      // Now we have to write palette data. This means we must take
-      // the original raw data, convert it into palette indices
-      // and write it to output. First we'll collect the necessary
-      // meta data, then we'll do the actual conversion to palette
-      // indices one row at a time.
-
-      // There are no more than 256 colours at this point. There is
-      // little point in allocating true size arrays on the heap,
-      // the sizes are so small. Hence fixed sizes.
-
-      // transparencies of non-opaque colours and the RGB values
-      png_byte transparent_values[256];  // NOLINT cannot use std::array here
-      png_color color_values[256];       // NOLINT cannot use std::array here
-
-      int num_transparent = 0;
-      int num_colors = 0;
-
-      // Collect the colours in the palette in use-count order. Since transparent
-      // colours are no longer guaranteed to come first, num_transparent may extend
-      // further into the palette than with the old alpha-ascending ordering. The
-      // tRNS table is still only as long as the highest-indexed transparent colour.
-
-      // This will store the colour map index for each colour
-      std::map<Color, int> color_indices;
-
-      for (const Color color : palette)
-      {
-        // Store the index for this new unique colour
-        color_indices.insert(std::make_pair(color, color_indices.size()));
-
-        // And inform libpng of its properties
-        auto a = static_cast<png_byte>(alpha(color));
-        color_values[num_colors].red =
-            unpremultiply_color_component(static_cast<png_byte>(red(color)), a);
-        color_values[num_colors].green =
-            unpremultiply_color_component(static_cast<png_byte>(green(color)), a);
-        color_values[num_colors].blue =
-            unpremultiply_color_component(static_cast<png_byte>(blue(color)), a);
-
-        // No need to skip storing here even if num_transparent increases no longer
-        transparent_values[num_colors] = a;
-
-        ++num_colors;
-
-        if (a < 255)
-          num_transparent = num_colors;
-      }
-
-      // Setup the libpng storing method
-      png_set_IHDR(png,
-                   info,
-                   width,
-                   height,
-                   8,
-                   PNG_COLOR_TYPE_PALETTE,
-                   PNG_INTERLACE_NONE,
-                   PNG_COMPRESSION_TYPE_DEFAULT,
-                   PNG_FILTER_TYPE_DEFAULT);
-
-      // This may be occasionally useful if some errors are encountered but
-      // you still want to see what the image would look like.
-      // png_set_benign_errors(png,1);
-
-      // Set transparencies, if there are any
-      if (num_transparent > 0)
-        png_set_tRNS(png, info, transparent_values, num_transparent, nullptr);
-
-      // Set the opaque RGB palette
-      png_set_PLTE(png, info, color_values, num_colors);
-
-      // Write PNG raw data
-
-      png_write_info(png, info);
-
-      // Using this vector of palette indices to convert all rows in the ARGB cairo input
-      std::vector<png_byte> rows(width, 0);
-
-      for (int i = 0; i < height; i++)
-      {
-        // Convert cairo ARGB row to array of palette indices
-        auto *row = static_cast<png_byte *>(data + i * stride);
-        for (int j = 0; j < width; j++)
-        {
-          Color c = *reinterpret_cast<Color *>(row);
-          rows[j] = color_indices.at(c);
-          row += 4;
-        }
-        // And write the indices
-        png_write_row(png, rows.data());
-      }
-
-      // Write PNG tail, deallocate memory
-      png_write_end(png, info);
-      png_destroy_write_struct(&png, &info);
-    }
+    Encoder encoder;
+    return encoder.towebp(image, options, webpOptions);
   }
   catch (...)
   {
@@ -653,37 +166,41 @@ void write_png_libpng(cairo_surface_t *image, const ColorMapper &mapper, std::st
   }
 }
 
-// Write a Cairo surface to a PNG string. Uses the libdeflate-based writer by default; set
-// GIZA_USE_LIBPNG to fall back to the original libpng path (kept for comparison/safety while
-// the libdeflate writer is being validated).
-void giza_surface_write_to_png_string(cairo_surface_t *image,
-                                      const ColorMapper &mapper,
-                                      std::string &buffer)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surfaces to an animated WEBP string
+ */
+// ----------------------------------------------------------------------
+
+std::string towebpanim(const std::vector<cairo_surface_t *> &frames,
+                       const std::vector<int> &durations,
+                       int loop_count,
+                       const ColorMapOptions &options,
+                       const WebpOptions &webpOptions)
 {
-  if (std::getenv("GIZA_USE_LIBPNG") != nullptr)
-    write_png_libpng(image, mapper, buffer);
-  else
-    write_png_libdeflate(image, mapper, buffer);
+  try
+  {
+    Encoder encoder;
+    return encoder.towebpanim(frames, durations, loop_count, options, webpOptions);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
 }
 
-}  // namespace
-
 // ----------------------------------------------------------------------
 /*!
  * \brief Write cairo surface to a PNG string
  */
 // ----------------------------------------------------------------------
 
-std::string towebp(cairo_surface_t *image)
+std::string topng(cairo_surface_t *image)
 {
   try
   {
-    ColorMapper mapper;
-    mapper.reduce(image);
-
-    std::string buffer;
-    giza_surface_write_to_webp_string(image, buffer, WebpOptions());
-    return buffer;
+    Encoder encoder;
+    return encoder.topng(image, ColorMapOptions(), PngOptions());
   }
   catch (...)
   {
@@ -697,11 +214,12 @@ std::string towebp(cairo_surface_t *image)
  */
 // ----------------------------------------------------------------------
 
-std::string towebp(cairo_surface_t *image, const ColorMapOptions &options)
+std::string topng(cairo_surface_t *image, const ColorMapOptions &options)
 {
   try
   {
-    return towebp(image, options, WebpOptions());
+    Encoder encoder;
+    return encoder.topng(image, options, PngOptions());
   }
   catch (...)
   {
@@ -711,23 +229,18 @@ std::string towebp(cairo_surface_t *image, const ColorMapOptions &options)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Write cairo surface to a WEBP string with explicit encoder options
+ * \brief Write cairo surface to a PNG string with explicit encoder options
  */
 // ----------------------------------------------------------------------
 
-std::string towebp(cairo_surface_t *image,
-                   const ColorMapOptions &options,
-                   const WebpOptions &webpOptions)
+std::string topng(cairo_surface_t *image,
+                  const ColorMapOptions &options,
+                  const PngOptions &pngOptions)
 {
   try
   {
-    ColorMapper mapper;
-    mapper.options(options);
-    mapper.reduce(image);
-
-    std::string buffer;
-    giza_surface_write_to_webp_string(image, buffer, webpOptions);
-    return buffer;
+    Encoder encoder;
+    return encoder.topng(image, options, pngOptions);
   }
   catch (...)
   {
@@ -737,116 +250,56 @@ std::string towebp(cairo_surface_t *image,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Write cairo surfaces to an animated WEBP string
+ * \brief Write cairo surface to a PNG string without modifying it
  */
 // ----------------------------------------------------------------------
 
-std::string towebpanim(const std::vector<cairo_surface_t *> &frames,
-                       const std::vector<int> &durations,
-                       int loop_count,
-                       const ColorMapOptions &options,
-                       const WebpOptions &webpOptions)
+std::string topng_preserve(cairo_surface_t *image)
 {
   try
   {
-    if (frames.empty())
-      throw Fmi::Exception(BCP, "Giza::towebpanim requires at least one frame");
-
-    if (durations.size() != frames.size())
-      throw Fmi::Exception(BCP, "Giza::towebpanim requires one duration for each frame");
-
-    int width = cairo_image_surface_get_width(frames[0]);
-    int height = cairo_image_surface_get_height(frames[0]);
-
-    WebPConfig config;
-    if (!WebPConfigInit(&config))
-      throw Fmi::Exception(BCP, "Failed to initialize libwebp configuration");
-    config.lossless = 1;
-    if (webpOptions.level >= 0)
-      if (!WebPConfigLosslessPreset(&config, std::clamp(webpOptions.level, 0, 9)))
-        throw Fmi::Exception(BCP, "Invalid libwebp lossless preset level");
-    if (!WebPValidateConfig(&config))
-      throw Fmi::Exception(BCP, "Invalid libwebp configuration");
-
-    WebPAnimEncoderOptions enc_options;
-    if (!WebPAnimEncoderOptionsInit(&enc_options))
-      throw Fmi::Exception(BCP, "Failed to initialize libwebp animation encoder options");
-    enc_options.anim_params.loop_count = std::max(0, loop_count);
-
-    WebPAnimEncoder *enc = WebPAnimEncoderNew(width, height, &enc_options);
-    if (enc == nullptr)
-      throw Fmi::Exception(BCP, "Failed to create libwebp animation encoder");
-
-    std::string buffer;
-    try
-    {
-      int timestamp = 0;
-      for (std::size_t i = 0; i < frames.size(); i++)
-      {
-        auto *image = frames[i];
-
-        if (cairo_image_surface_get_width(image) != width ||
-            cairo_image_surface_get_height(image) != height)
-          throw Fmi::Exception(BCP, "Giza::towebpanim frames must be of equal size");
-
-        ColorMapper mapper;
-        mapper.options(options);
-        mapper.reduce(image);
-
-        int w = 0;
-        int h = 0;
-        int stride = 0;
-        unsigned char *data = surface_to_unpremultiplied_rgba(image, w, h, stride);
-
-        WebPPicture pic;
-        if (!WebPPictureInit(&pic))
-          throw Fmi::Exception(BCP, "Failed to initialize libwebp picture");
-        pic.use_argb = 1;
-        pic.width = width;
-        pic.height = height;
-
-        if (!WebPPictureImportRGBA(&pic, data, stride))
-        {
-          WebPPictureFree(&pic);
-          throw Fmi::Exception(BCP, "Failed to import frame into libwebp picture");
-        }
-
-        bool ok = WebPAnimEncoderAdd(enc, &pic, timestamp, &config);
-        WebPPictureFree(&pic);
-
-        if (!ok)
-          throw Fmi::Exception(BCP, "libwebp animation encoding failed")
-              .addParameter("error", WebPAnimEncoderGetError(enc));
-
-        timestamp += durations[i];
-      }
-
-      // Flush the encoder with the total duration as the final timestamp
+    Encoder encoder;
+    return encoder.topng_preserve(image, ColorMapOptions(), PngOptions());
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
 
-      if (!WebPAnimEncoderAdd(enc, nullptr, timestamp, nullptr))
-        throw Fmi::Exception(BCP, "Failed to flush libwebp animation encoder")
-            .addParameter("error", WebPAnimEncoderGetError(enc));
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a PNG string without modifying it
+ */
+// ----------------------------------------------------------------------
 
-      WebPData webp_data;
-      WebPDataInit(&webp_data);
-      if (!WebPAnimEncoderAssemble(enc, &webp_data))
-      {
-        WebPDataClear(&webp_data);
-        throw Fmi::Exception(BCP, "Failed to assemble libwebp animation")
-            .addParameter("error", WebPAnimEncoderGetError(enc));
-      }
+std::string topng_preserve(cairo_surface_t *image, const ColorMapOptions &options)
+{
+  try
+  {
+    Encoder encoder;
+    return encoder.topng_preserve(image, options, PngOptions());
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
 
-      buffer.assign(reinterpret_cast<const char *>(webp_data.bytes), webp_data.size);
-      WebPDataClear(&webp_data);
-    }
-    catch (...)
-    {
-      WebPAnimEncoderDelete(enc);
-      throw;
-    }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write cairo surface to a PNG string without modifying it, explicit options
+ */
+// ----------------------------------------------------------------------
 
-    WebPAnimEncoderDelete(enc);
-    return buffer;
+std::string topng_preserve(cairo_surface_t *image,
+                           const ColorMapOptions &options,
+                           const PngOptions &pngOptions)
+{
+  try
+  {
+    Encoder encoder;
+    return encoder.topng_preserve(image, options, pngOptions);
   }
   catch (...)
   {
@@ -856,20 +309,15 @@ std::string towebpanim(const std::vector<cairo_surface_t *> &frames,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Write cairo surface to a PNG string
+ * \brief Cut cairo surface into PNG tiles
  */
 // ----------------------------------------------------------------------
 
-std::string topng(cairo_surface_t *image)
+Tiles encodeTiles(cairo_surface_t *image, int tileSize, const ColorMapOptions &options)
 {
   try
   {
-    ColorMapper mapper;
-    mapper.reduce(image);
-
-    std::string buffer;
-    giza_surface_write_to_png_string(image, mapper, buffer);
-    return buffer;
+    return encodeTiles(image, tileSize, options, PngOptions());
   }
   catch (...)
   {
@@ -879,21 +327,128 @@ std::string topng(cairo_surface_t *image)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Write cairo surface to a PNG string
+ * \brief Cut cairo surface into PNG tiles with explicit encoder options
+ *
+ * The color map and the palette are calculated once for the whole image,
+ * so that the colors of adjacent tiles match and palette images share the
+ * same palette. The tiles are encoded directly from the pixels of the
+ * image. Tiles identical to an earlier tile are not encoded again, they
+ * share the data of the earlier tile.
  */
 // ----------------------------------------------------------------------
 
-std::string topng(cairo_surface_t *image, const ColorMapOptions &options)
+Tiles encodeTiles(cairo_surface_t *image,
+                  int tileSize,
+                  const ColorMapOptions &options,
+                  const PngOptions &pngOptions)
 {
   try
   {
+    if (tileSize <= 0)
+      throw Fmi::Exception(BCP, "Giza::encodeTiles requires a positive tile size");
+
+    cairo_surface_flush(image);
+    if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32)
+      throw Fmi::Exception(BCP, "Giza::encodeTiles can write only Cairo ARGB32 format images");
+
     ColorMapper mapper;
     mapper.options(options);
-    mapper.reduce(image);
+    mapper.analyze(image);
+
+    unsigned char *data = cairo_image_surface_get_data(image);
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+
+    Tiles result;
+    result.columns = (width + tileSize - 1) / tileSize;
+    result.rows = (height + tileSize - 1) / tileSize;
+    const int n = result.columns * result.rows;
+    result.tiles.resize(n);
+
+    std::vector<Tile> tiles(n);
+    for (int row = 0; row < result.rows; row++)
+      for (int column = 0; column < result.columns; column++)
+      {
+        Tile &tile = tiles[row * result.columns + column];
+        const int x = column * tileSize;
+        const int y = row * tileSize;
+        tile.data = data + static_cast<std::size_t>(y) * stride + 4 * static_cast<std::size_t>(x);
+        tile.width = std::min(tileSize, width - x);
+        tile.height = std::min(tileSize, height - y);
+        tile.stride = stride;
+      }
+
+    const int threads = worker_count(options.threads);
+    const int bands = band_count(1, n, threads, 1);
+
+    // Find the first occurrence of each distinct tile
+
+    std::vector<std::string> keys(n);
+    parallel_bands(n,
+                   bands,
+                   [&](int /* band */, int first, int last)
+                   {
+                     for (int i = first; i < last; i++)
+                       keys[i] = tile_key(tiles[i]);
+                   });
+
+    std::vector<int> original(n);
+    std::vector<int> distinct;
+    std::unordered_map<std::string, std::vector<int>> seen;
+    for (int i = 0; i < n; i++)
+    {
+      original[i] = i;
+      auto &candidates = seen[keys[i]];
+      for (int j : candidates)
+        if (tiles[j] == tiles[i])
+        {
+          original[i] = j;
+          break;
+        }
+      if (original[i] == i)
+      {
+        candidates.push_back(i);
+        distinct.push_back(i);
+      }
+    }
 
-    std::string buffer;
-    giza_surface_write_to_png_string(image, mapper, buffer);
-    return buffer;
+    // Encode the distinct tiles. The tiles are dealt to the workers in turn
+    // so that the cheap and the expensive parts of the image are shared.
+
+    const int m = static_cast<int>(distinct.size());
+    const int workers = band_count(1, m, threads, 1);
+    parallel_bands(workers,
+                   workers,
+                   [&](int worker, int /* first */, int /* last */)
+                   {
+                     Encoder encoder;
+                     std::string buffer;
+                     for (int k = worker; k < m; k += workers)
+                     {
+                       const Tile &tile = tiles[distinct[k]];
+                       auto *view = cairo_image_surface_create_for_data(
+                           tile.data, CAIRO_FORMAT_ARGB32, tile.width, tile.height, tile.stride);
+                       try
+                       {
+                         if (cairo_surface_status(view) != CAIRO_STATUS_SUCCESS)
+                           throw Fmi::Exception(BCP, "Failed to create a Cairo view of a tile");
+                         encoder.topng_mapped(view, mapper, pngOptions, buffer);
+                       }
+                       catch (...)
+                       {
+                         cairo_surface_destroy(view);
+                         throw;
+                       }
+                       cairo_surface_destroy(view);
+                       result.tiles[distinct[k]] = std::make_shared<const std::string>(buffer);
+                     }
+                   });
+
+    for (int i = 0; i < n; i++)
+      result.tiles[i] = result.tiles[original[i]];
+
+    return result;
   }
   catch (...)
   {
@@ -1,16 +1,48 @@
 #pragma once
 #include <cairo/cairo.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace Giza
 {
 struct ColorMapOptions;
+struct PngOptions;
 struct WebpOptions;
 
 std::string topng(cairo_surface_t* image);
 std::string topng(cairo_surface_t* image, const ColorMapOptions& options);
+std::string topng(cairo_surface_t* image,
+                  const ColorMapOptions& options,
+                  const PngOptions& pngOptions);
+
+// As topng, but the colors are reduced while encoding and the image is not modified
+std::string topng_preserve(cairo_surface_t* image);
+std::string topng_preserve(cairo_surface_t* image, const ColorMapOptions& options);
+std::string topng_preserve(cairo_surface_t* image,
+                           const ColorMapOptions& options,
+                           const PngOptions& pngOptions);
+
+// PNG tiles of an image, row by row starting from the top left corner. The
+// tiles on the right and bottom edges are smaller if the image size is not
+// a multiple of the tile size. Identical tiles share the same data.
+struct Tiles
+{
+  int columns = 0;
+  int rows = 0;
+  std::vector<std::shared_ptr<const std::string>> tiles;
+};
+
+// Cut the image into tiles which all use the color map of the whole image.
+// The tiles are encoded in parallel using options.threads, and the image
+// is not modified.
+Tiles encodeTiles(cairo_surface_t* image, int tileSize, const ColorMapOptions& options);
+Tiles encodeTiles(cairo_surface_t* image,
+                  int tileSize,
+                  const ColorMapOptions& options,
+                  const PngOptions& pngOptions);
+
 std::string towebp(cairo_surface_t* image);
 std::string towebp(cairo_surface_t* image, const ColorMapOptions& options);
 std::string towebp(cairo_surface_t* image,
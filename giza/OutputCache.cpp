@@ -0,0 +1,155 @@
+#include "OutputCache.h"
+#include <macgyver/Exception.h>
+
+namespace Giza
+{
+namespace
+{
+// Approximate memory used by an item in addition to its key and value
+constexpr std::size_t item_overhead = 128;
+
+std::size_t item_size(const std::string& key, const std::string& value)
+{
+  return key.size() + value.size() + item_overhead;
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The cache shared by all encoders
+ */
+// ----------------------------------------------------------------------
+
+OutputCache& OutputCache::instance()
+{
+  static OutputCache cache;
+  return cache;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the memory budget, discarding old items if necessary
+ */
+// ----------------------------------------------------------------------
+
+void OutputCache::maxsize(std::size_t bytes)
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    itsMaxSize = bytes;
+    shrink(bytes);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Memory used by the cached items
+ */
+// ----------------------------------------------------------------------
+
+std::size_t OutputCache::size() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsSize;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard all items
+ */
+// ----------------------------------------------------------------------
+
+void OutputCache::clear()
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    shrink(0);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the output for a key, marking it the most recently used
+ */
+// ----------------------------------------------------------------------
+
+bool OutputCache::find(const std::string& key, std::string& buffer)
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    auto pos = itsIndex.find(key);
+    if (pos == itsIndex.end())
+      return false;
+
+    itsItems.splice(itsItems.begin(), itsItems, pos->second);
+    buffer = pos->second->value;
+    return true;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store the output for a key
+ *
+ * Outputs larger than the whole budget are not stored. The least recently
+ * used items are discarded to make room for the new one.
+ */
+// ----------------------------------------------------------------------
+
+void OutputCache::insert(const std::string& key, const std::string& value)
+{
+  try
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+
+    const std::size_t size = item_size(key, value);
+    if (size > itsMaxSize || itsIndex.find(key) != itsIndex.end())
+      return;
+
+    shrink(itsMaxSize - size);
+
+    itsItems.push_front(Item{key, value});
+    itsIndex.emplace(itsItems.front().key, itsItems.begin());
+    itsSize += size;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard least recently used items until the size is within the limit
+ *
+ * The caller must hold the lock.
+ */
+// ----------------------------------------------------------------------
+
+void OutputCache::shrink(std::size_t maxsize)
+{
+  while (itsSize > maxsize && !itsItems.empty())
+  {
+    const Item& item = itsItems.back();
+    itsSize -= item_size(item.key, item.value);
+    itsIndex.erase(item.key);
+    itsItems.pop_back();
+  }
+}
+
+}  // namespace Giza
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Least recently used cache of encoded images
+ *
+ * Tile servers often encode identical images over and over again, for
+ * example empty tiles or the same legend at every zoom level. The encoders
+ * look up each image by a hash of its pixels and the encoding options, and
+ * a hit returns the stored output without any color reduction or
+ * compression.
+ *
+ * The process wide cache used by the encoders is disabled until it is given
+ * a size, for example
+ *
+ *   Giza::OutputCache::instance().maxsize(100 * 1024 * 1024);
+ *
+ * The image is not modified by topng or towebp when the output is found
+ * from the cache. The cache may be used by several threads simultaneously.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+class OutputCache
+{
+ public:
+  explicit OutputCache(std::size_t maxsize = 0) : itsMaxSize(maxsize) {}
+  OutputCache(const OutputCache& other) = delete;
+  OutputCache& operator=(const OutputCache& other) = delete;
+
+  // The cache used by the encoders
+  static OutputCache& instance();
+
+  // Memory budget in bytes including the keys, zero disables the cache
+  void maxsize(std::size_t bytes);
+  std::size_t maxsize() const { return itsMaxSize; }
+  bool enabled() const { return itsMaxSize > 0; }
+
+  // Memory used in bytes
+  std::size_t size() const;
+  void clear();
+
+  // Copy the output for the key to the buffer, returns false if not found
+  bool find(const std::string& key, std::string& buffer);
+  void insert(const std::string& key, const std::string& value);
+
+ private:
+  struct Item
+  {
+    std::string key;
+    std::string value;
+  };
+
+  void shrink(std::size_t maxsize);
+
+  mutable std::mutex itsMutex;
+  std::list<Item> itsItems;  // most recently used first
+  std::unordered_map<std::string_view, std::list<Item>::iterator> itsIndex;  // keys of itsItems
+  std::size_t itsSize = 0;
+  std::atomic<std::size_t> itsMaxSize;
+
+};  // class OutputCache
+
+}  // namespace Giza
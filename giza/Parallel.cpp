@@ -0,0 +1,105 @@
+#include "Parallel.h"
+#include <macgyver/Exception.h>
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace Giza
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Resolve the number of worker threads to use
+ */
+// ----------------------------------------------------------------------
+
+int worker_count(int requested)
+{
+  if (requested > 0)
+    return requested;
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Number of row bands to split an image into
+ */
+// ----------------------------------------------------------------------
+
+int band_count(int width, int height, int threads, int min_band_pixels)
+{
+  const long long pixels = static_cast<long long>(width) * height;
+  if (pixels <= 0 || threads <= 1)
+    return 1;
+
+  const long long maxbands = std::max(1LL, pixels / std::max(1, min_band_pixels));
+  return static_cast<int>(std::min({static_cast<long long>(threads), maxbands, 1LL * height}));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process row bands in parallel
+ */
+// ----------------------------------------------------------------------
+
+void parallel_bands(int height, int bands, const std::function<void(int, int, int)>& fn)
+{
+  try
+  {
+    bands = std::max(1, std::min(bands, height));
+
+    // Band b covers rows [b*height/bands, (b+1)*height/bands)
+    auto first_row = [height, bands](int band)
+    { return static_cast<int>(static_cast<long long>(band) * height / bands); };
+
+    if (bands == 1)
+    {
+      fn(0, 0, height);
+      return;
+    }
+
+    std::vector<std::exception_ptr> errors(bands);
+    std::vector<std::thread> workers;
+    workers.reserve(bands - 1);
+
+    auto run = [&](int band)
+    {
+      try
+      {
+        fn(band, first_row(band), first_row(band + 1));
+      }
+      catch (...)
+      {
+        errors[band] = std::current_exception();
+      }
+    };
+
+    try
+    {
+      for (int band = 1; band < bands; band++)
+        workers.emplace_back(run, band);
+    }
+    catch (...)
+    {
+      // Could not start all the threads, wait for the ones that did start
+      for (auto& worker : workers)
+        worker.join();
+      throw;
+    }
+
+    run(0);
+
+    for (auto& worker : workers)
+      worker.join();
+
+    for (const auto& error : errors)
+      if (error)
+        std::rethrow_exception(error);
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Giza
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <functional>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Helpers for splitting image processing into row bands
+ *
+ * The image passes (histogram, color replacement etc) are independent
+ * per row, so they are parallelized by giving each worker a consecutive
+ * band of rows. The calling thread processes the first band itself.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+// Resolve a requested worker count. Values <= 0 mean one worker per hardware thread.
+int worker_count(int requested);
+
+// Number of bands to use for an image so that each band has at least the given
+// number of pixels. Returns 1 if the image is too small to be worth splitting.
+int band_count(int width, int height, int threads, int min_band_pixels);
+
+// Split rows [0,height) into the given number of bands of nearly equal size and
+// call fn(band, row1, row2) for each band in parallel. The first exception thrown
+// by any band is rethrown once all the bands have finished.
+void parallel_bands(int height, int bands, const std::function<void(int, int, int)>& fn);
+
+}  // namespace Giza
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Giza
+{
+struct PngOptions
+{
+  // Number of threads for compressing the image data. Data larger than
+  // parallelsize bytes is split into chunks which are compressed in
+  // parallel, giving a standard zlib stream which is slightly larger than
+  // the one compressed in one piece. The default 1 disables the splitting,
+  // values <= 0 mean one thread per hardware thread.
+  int threads = 1;
+  std::size_t parallelsize = 4 * 1024 * 1024;
+
+  // Images whose scanlines take more than bandsize bytes are written in
+  // bands of about this size, which are generated, compressed and emitted
+  // one at a time. This bounds the working memory needed for very large
+  // images to a few times the band size in addition to the output itself.
+  std::size_t bandsize = 64 * 1024 * 1024;
+
+  // Scanline filter for true color and gray images, which helps compressing
+  // smooth gradients. Palette images are not filtered, as the PNG
+  // specification recommends. Adaptive chooses the filter of each scanline
+  // by the minimum sum of absolute differences.
+  enum Filter
+  {
+    None = 0,
+    Sub = 1,
+    Up = 2,
+    Average = 3,
+    Paeth = 4,
+    Adaptive = 5
+  };
+  Filter filter = None;
+};
+}  // namespace Giza
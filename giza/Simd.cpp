@@ -0,0 +1,926 @@
+#include "Simd.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef GIZA_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace Giza
+{
+namespace Simd
+{
+namespace
+{
+// ----------------------------------------------------------------------
+/*
+ * Portable versions
+ */
+// ----------------------------------------------------------------------
+
+std::size_t color_run_scalar(const Color* pixels, std::size_t n, Color color)
+{
+  std::size_t i = 0;
+  while (i < n && pixels[i] == color)
+    ++i;
+  return i;
+}
+
+// Continue a streak of matching columns, returning true once it reaches three
+bool triple_scalar(
+    const Color* row1, const Color* row2, std::size_t n, Color color, unsigned int streak)
+{
+  for (std::size_t i = 0; i < n; i++)
+  {
+    if (row1[i] == color && row2[i] == color)
+    {
+      if (++streak >= 3)
+        return true;
+    }
+    else
+      streak = 0;
+  }
+  return false;
+}
+
+// Length of the trailing streak of set bits in the lowest 'bits' bits of mask, capped at 2
+unsigned int trailing_streak(unsigned int mask, unsigned int bits)
+{
+  const unsigned int last = (mask >> (bits - 1)) & 1U;
+  const unsigned int prev = (mask >> (bits - 2)) & 1U;
+  return last == 0 ? 0 : (prev == 0 ? 1 : 2);
+}
+
+// Does mask, preceded by a streak of 0-2 matching columns, contain three consecutive set bits?
+bool mask_has_triple(unsigned int mask, unsigned int streak)
+{
+  // Prepend the streak as the two lowest bits
+  const unsigned int prefix = (streak == 2 ? 3U : streak == 1 ? 2U : 0U);
+  const unsigned int bits = (mask << 2) | prefix;
+  return (bits & (bits >> 1) & (bits >> 2)) != 0;
+}
+
+void opaque_gray_scalar(const Color* pixels, std::size_t n, bool& opaque, bool& gray)
+{
+  Color alphas = 0xff000000U;
+  Color chroma = 0;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    alphas &= pixels[i];
+    chroma |= (pixels[i] ^ (pixels[i] >> 8)) & 0xffffU;  // red^green and green^blue
+  }
+  opaque = opaque && (alphas == 0xff000000U);
+  gray = gray && (chroma == 0);
+}
+
+// PNG filters from byte 'begin' on. The left neighbours of the first bpp bytes are zero.
+
+void sub_scalar(
+    const uint8_t* row, std::size_t begin, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+  for (std::size_t i = begin; i < n; i++)
+    out[i] = static_cast<uint8_t>(row[i] - (i >= bpp ? row[i - bpp] : 0));
+}
+
+void up_scalar(
+    const uint8_t* row, const uint8_t* prior, std::size_t begin, std::size_t n, uint8_t* out)
+{
+  for (std::size_t i = begin; i < n; i++)
+    out[i] = static_cast<uint8_t>(row[i] - prior[i]);
+}
+
+void average_scalar(const uint8_t* row,
+                    const uint8_t* prior,
+                    std::size_t begin,
+                    std::size_t n,
+                    std::size_t bpp,
+                    uint8_t* out)
+{
+  for (std::size_t i = begin; i < n; i++)
+  {
+    const unsigned int left = (i >= bpp ? row[i - bpp] : 0);
+    out[i] = static_cast<uint8_t>(row[i] - ((left + prior[i]) >> 1));
+  }
+}
+
+uint8_t paeth_predictor(int a, int b, int c)
+{
+  const int pa = std::abs(b - c);
+  const int pb = std::abs(a - c);
+  const int pc = std::abs(a + b - 2 * c);
+  if (pa <= pb && pa <= pc)
+    return static_cast<uint8_t>(a);
+  if (pb <= pc)
+    return static_cast<uint8_t>(b);
+  return static_cast<uint8_t>(c);
+}
+
+void paeth_scalar(const uint8_t* row,
+                  const uint8_t* prior,
+                  std::size_t begin,
+                  std::size_t n,
+                  std::size_t bpp,
+                  uint8_t* out)
+{
+  for (std::size_t i = begin; i < n; i++)
+  {
+    const int left = (i >= bpp ? row[i - bpp] : 0);
+    const int upleft = (i >= bpp ? prior[i - bpp] : 0);
+    out[i] = static_cast<uint8_t>(row[i] - paeth_predictor(left, prior[i], upleft));
+  }
+}
+
+void pack_scalar(const uint8_t* indices, std::size_t n, int bits, uint8_t* out)
+{
+  const int per_byte = 8 / bits;
+  for (std::size_t i = 0; i < n; i += per_byte)
+  {
+    unsigned int value = 0;
+    for (int k = 0; k < per_byte; k++)
+      value = (value << bits) | (i + k < n ? indices[i + k] : 0);
+    *out++ = static_cast<uint8_t>(value);
+  }
+}
+
+std::size_t cost_scalar(const uint8_t* data, std::size_t n)
+{
+  std::size_t sum = 0;
+  for (std::size_t i = 0; i < n; i++)
+    sum += (data[i] < 128 ? data[i] : 256 - data[i]);
+  return sum;
+}
+
+// The hash accumulates 32-byte stripes into four 64-bit lanes in the manner of
+// XXH3: each lane adds the product of the low and high halves of the data mixed
+// with a key, and the neighbouring lane adds the data itself. The keys advance
+// with each stripe so that the result depends on the positions of the data.
+
+constexpr uint64_t hash_keys[4] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL};
+constexpr uint64_t hash_steps[4] = {
+    0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL};
+
+void hash_scalar(const uint8_t* data, std::size_t stripes, uint64_t key[4], uint64_t acc[4])
+{
+  for (std::size_t s = 0; s < stripes; s++)
+  {
+    uint64_t d[4];
+    std::memcpy(d, data + 32 * s, sizeof(d));
+    for (int j = 0; j < 4; j++)
+    {
+      const uint64_t k = d[j] ^ key[j];
+      acc[j] += (k & 0xffffffffU) * (k >> 32);
+      acc[j ^ 1] += d[j];
+      key[j] += hash_steps[j];
+    }
+  }
+}
+
+// Final avalanche of the lanes, see splitmix64
+uint64_t hash_mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+#ifdef GIZA_HAVE_X86_SIMD
+
+// ----------------------------------------------------------------------
+/*
+ * SSE2 versions, 4 pixels per compare. SSE2 is part of x86-64.
+ */
+// ----------------------------------------------------------------------
+
+__attribute__((target("sse2"))) std::size_t color_run_sse2(const Color* pixels,
+                                                           std::size_t n,
+                                                           Color color)
+{
+  const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+    const auto mask =
+        static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, c))));
+    if (mask != 0xFU)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + color_run_scalar(pixels + i, n - i, color);
+}
+
+__attribute__((target("sse2"))) bool has_solid_triple_sse2(const Color* row1,
+                                                           const Color* row2,
+                                                           std::size_t n,
+                                                           Color color)
+{
+  const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+  unsigned int streak = 0;
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+    const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row2 + i));
+    const __m128i eq = _mm_and_si128(_mm_cmpeq_epi32(v1, c), _mm_cmpeq_epi32(v2, c));
+    const auto mask = static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+    if (mask_has_triple(mask, streak))
+      return true;
+    streak = trailing_streak(mask, 4);
+  }
+  return triple_scalar(row1 + i, row2 + i, n - i, color, streak);
+}
+
+// The filters predict from the unfiltered data only, so all bytes can be
+// filtered independently 16 at a time. The Paeth predictor is evaluated
+// with 16-bit arithmetic.
+
+__attribute__((target("sse2"))) void sub_sse2(const uint8_t* row,
+                                              std::size_t n,
+                                              std::size_t bpp,
+                                              uint8_t* out)
+{
+  sub_scalar(row, 0, std::min(bpp, n), bpp, out);
+  std::size_t i = bpp;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(x, a));
+  }
+  sub_scalar(row, i, n, bpp, out);
+}
+
+__attribute__((target("sse2"))) void up_sse2(const uint8_t* row,
+                                             const uint8_t* prior,
+                                             std::size_t n,
+                                             uint8_t* out)
+{
+  std::size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(x, b));
+  }
+  up_scalar(row, prior, i, n, out);
+}
+
+__attribute__((target("sse2"))) void average_sse2(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+  average_scalar(row, prior, 0, std::min(bpp, n), bpp, out);
+  const __m128i one = _mm_set1_epi8(1);
+  std::size_t i = bpp;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    // _mm_avg_epu8 rounds up, the filter rounds down
+    const __m128i avg =
+        _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(x, avg));
+  }
+  average_scalar(row, prior, i, n, bpp, out);
+}
+
+__attribute__((target("sse2"))) __m128i abs_epi16_sse2(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Paeth predictor of eight bytes in 16-bit lanes
+__attribute__((target("sse2"))) __m128i paeth_epi16_sse2(__m128i a, __m128i b, __m128i c)
+{
+  const __m128i bc = _mm_sub_epi16(b, c);
+  const __m128i ac = _mm_sub_epi16(a, c);
+  const __m128i pa = abs_epi16_sse2(bc);
+  const __m128i pb = abs_epi16_sse2(ac);
+  const __m128i pc = abs_epi16_sse2(_mm_add_epi16(bc, ac));
+  const __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  const __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+  const __m128i bc_choice = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+  return _mm_or_si128(_mm_and_si128(not_a, bc_choice), _mm_andnot_si128(not_a, a));
+}
+
+__attribute__((target("sse2"))) void paeth_sse2(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+  paeth_scalar(row, prior, 0, std::min(bpp, n), bpp, out);
+  const __m128i zero = _mm_setzero_si128();
+  std::size_t i = bpp;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i - bpp));
+    const __m128i lo = paeth_epi16_sse2(
+        _mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    const __m128i hi = paeth_epi16_sse2(
+        _mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+  }
+  paeth_scalar(row, prior, i, n, bpp, out);
+}
+
+// The pixels are tested in blocks so that the scan can stop early
+constexpr std::size_t opaque_gray_block = 256;
+
+__attribute__((target("sse2"))) void opaque_gray_sse2(const Color* pixels,
+                                                      std::size_t n,
+                                                      bool& opaque,
+                                                      bool& gray)
+{
+  const __m128i low = _mm_set1_epi32(0xffff);
+  std::size_t i = 0;
+  while (i + 4 <= n && (opaque || gray))
+  {
+    __m128i alphas = _mm_set1_epi32(-1);
+    __m128i chroma = _mm_setzero_si128();
+    const std::size_t end = std::min(n, i + opaque_gray_block) & ~std::size_t{3};
+    for (; i < end; i += 4)
+    {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+      alphas = _mm_and_si128(alphas, v);
+      chroma = _mm_or_si128(chroma, _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), low));
+    }
+    const __m128i alpha_ok = _mm_cmpeq_epi32(_mm_srli_epi32(alphas, 24), _mm_set1_epi32(0xff));
+    const __m128i gray_ok = _mm_cmpeq_epi32(chroma, _mm_setzero_si128());
+    opaque = opaque && (_mm_movemask_epi8(alpha_ok) == 0xffff);
+    gray = gray && (_mm_movemask_epi8(gray_ok) == 0xffff);
+  }
+  if (opaque || gray)
+    opaque_gray_scalar(pixels + i, n - i, opaque, gray);
+}
+
+// Index packing halves the data in steps: the bytes of each 16-bit lane are
+// merged as (first << shift) | second and the lanes of two vectors are then
+// packed back to bytes. 4-bit indices need one step, 2-bit two and 1-bit three.
+
+__attribute__((target("sse2"))) __m128i merge_pairs_sse2(__m128i v0, __m128i v1, int shift)
+{
+  const __m128i low = _mm_set1_epi16(0xff);
+  const __m128i m0 = _mm_or_si128(_mm_sll_epi16(_mm_and_si128(v0, low), _mm_cvtsi32_si128(shift)),
+                                  _mm_srli_epi16(v0, 8));
+  const __m128i m1 = _mm_or_si128(_mm_sll_epi16(_mm_and_si128(v1, low), _mm_cvtsi32_si128(shift)),
+                                  _mm_srli_epi16(v1, 8));
+  return _mm_packus_epi16(m0, m1);
+}
+
+__attribute__((target("sse2"))) void pack_sse2(const uint8_t* indices,
+                                               std::size_t n,
+                                               int bits,
+                                               uint8_t* out)
+{
+  const int steps = (bits == 4 ? 1 : bits == 2 ? 2 : 3);
+  const std::size_t block = std::size_t{16} << steps;  // indices per 16 output bytes
+  std::size_t i = 0;
+  for (; i + block <= n; i += block)
+  {
+    __m128i v[8];
+    const int count = 1 << steps;
+    for (int k = 0; k < count; k++)
+      v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i + 16 * k));
+    for (int shift = bits, m = count; m > 1; shift *= 2, m /= 2)
+      for (int k = 0; k < m / 2; k++)
+        v[k] = merge_pairs_sse2(v[2 * k], v[2 * k + 1], shift);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * bits / 8), v[0]);
+  }
+  pack_scalar(indices + i, n - i, bits, out + i * bits / 8);
+}
+
+__attribute__((target("sse2"))) std::size_t cost_sse2(const uint8_t* data, std::size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  std::size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    const __m128i absv = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(absv, zero));
+  }
+  uint64_t sums[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), sum);
+  return sums[0] + sums[1] + cost_scalar(data + i, n - i);
+}
+
+__attribute__((target("sse2"))) void hash_sse2(const uint8_t* data,
+                                               std::size_t stripes,
+                                               uint64_t key[4],
+                                               uint64_t acc[4])
+{
+  __m128i acc0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc));
+  __m128i acc1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + 2));
+  __m128i key0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+  __m128i key1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 2));
+  const __m128i step0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_steps));
+  const __m128i step1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_steps + 2));
+  for (std::size_t s = 0; s < stripes; s++)
+  {
+    const __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32 * s));
+    const __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32 * s + 16));
+    const __m128i k0 = _mm_xor_si128(d0, key0);
+    const __m128i k1 = _mm_xor_si128(d1, key1);
+    acc0 = _mm_add_epi64(acc0, _mm_mul_epu32(k0, _mm_srli_epi64(k0, 32)));
+    acc1 = _mm_add_epi64(acc1, _mm_mul_epu32(k1, _mm_srli_epi64(k1, 32)));
+    acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+    key0 = _mm_add_epi64(key0, step0);
+    key1 = _mm_add_epi64(key1, step1);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), acc0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + 2), acc1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(key), key0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(key + 2), key1);
+}
+
+// ----------------------------------------------------------------------
+/*
+ * AVX2 versions, 8 pixels per compare and 16 per iteration in color_run
+ */
+// ----------------------------------------------------------------------
+
+__attribute__((target("avx2"))) std::size_t color_run_avx2(const Color* pixels,
+                                                           std::size_t n,
+                                                           Color color)
+{
+  const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+  std::size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+    const __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i + 8));
+    const auto mask1 = static_cast<unsigned int>(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v1, c))));
+    const auto mask2 = static_cast<unsigned int>(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v2, c))));
+    const unsigned int mask = mask1 | (mask2 << 8);
+    if (mask != 0xFFFFU)
+      return i + __builtin_ctz(~mask);
+  }
+  for (; i + 8 <= n; i += 8)
+  {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+    const auto mask = static_cast<unsigned int>(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, c))));
+    if (mask != 0xFFU)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + color_run_scalar(pixels + i, n - i, color);
+}
+
+__attribute__((target("avx2"))) bool has_solid_triple_avx2(const Color* row1,
+                                                           const Color* row2,
+                                                           std::size_t n,
+                                                           Color color)
+{
+  const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+  unsigned int streak = 0;
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    const __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + i));
+    const __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row2 + i));
+    const __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi32(v1, c), _mm256_cmpeq_epi32(v2, c));
+    const auto mask = static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+    if (mask_has_triple(mask, streak))
+      return true;
+    streak = trailing_streak(mask, 8);
+  }
+  return triple_scalar(row1 + i, row2 + i, n - i, color, streak);
+}
+
+// Unpacking to 16 bits and packing back both work within 128-bit lanes,
+// so the byte order is preserved as in the SSE2 versions
+
+__attribute__((target("avx2"))) void sub_avx2(const uint8_t* row,
+                                              std::size_t n,
+                                              std::size_t bpp,
+                                              uint8_t* out)
+{
+  sub_scalar(row, 0, std::min(bpp, n), bpp, out);
+  std::size_t i = bpp;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi8(x, a));
+  }
+  sub_scalar(row, i, n, bpp, out);
+}
+
+__attribute__((target("avx2"))) void up_avx2(const uint8_t* row,
+                                             const uint8_t* prior,
+                                             std::size_t n,
+                                             uint8_t* out)
+{
+  std::size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi8(x, b));
+  }
+  up_scalar(row, prior, i, n, out);
+}
+
+__attribute__((target("avx2"))) void average_avx2(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+  average_scalar(row, prior, 0, std::min(bpp, n), bpp, out);
+  const __m256i one = _mm256_set1_epi8(1);
+  std::size_t i = bpp;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior + i));
+    const __m256i avg =
+        _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi8(x, avg));
+  }
+  average_scalar(row, prior, i, n, bpp, out);
+}
+
+__attribute__((target("avx2"))) __m256i paeth_epi16_avx2(__m256i a, __m256i b, __m256i c)
+{
+  const __m256i bc = _mm256_sub_epi16(b, c);
+  const __m256i ac = _mm256_sub_epi16(a, c);
+  const __m256i pa = _mm256_abs_epi16(bc);
+  const __m256i pb = _mm256_abs_epi16(ac);
+  const __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+  const __m256i not_a =
+      _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+  const __m256i not_b = _mm256_cmpgt_epi16(pb, pc);
+  return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a);
+}
+
+__attribute__((target("avx2"))) void paeth_avx2(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+  paeth_scalar(row, prior, 0, std::min(bpp, n), bpp, out);
+  const __m256i zero = _mm256_setzero_si256();
+  std::size_t i = bpp;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior + i));
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior + i - bpp));
+    const __m256i lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero),
+                                        _mm256_unpacklo_epi8(b, zero),
+                                        _mm256_unpacklo_epi8(c, zero));
+    const __m256i hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero),
+                                        _mm256_unpackhi_epi8(b, zero),
+                                        _mm256_unpackhi_epi8(c, zero));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi)));
+  }
+  paeth_scalar(row, prior, i, n, bpp, out);
+}
+
+__attribute__((target("avx2"))) void opaque_gray_avx2(const Color* pixels,
+                                                      std::size_t n,
+                                                      bool& opaque,
+                                                      bool& gray)
+{
+  const __m256i low = _mm256_set1_epi32(0xffff);
+  std::size_t i = 0;
+  while (i + 8 <= n && (opaque || gray))
+  {
+    __m256i alphas = _mm256_set1_epi32(-1);
+    __m256i chroma = _mm256_setzero_si256();
+    const std::size_t end = std::min(n, i + opaque_gray_block) & ~std::size_t{7};
+    for (; i < end; i += 8)
+    {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+      alphas = _mm256_and_si256(alphas, v);
+      chroma = _mm256_or_si256(
+          chroma, _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi32(v, 8)), low));
+    }
+    const __m256i alpha_ok =
+        _mm256_cmpeq_epi32(_mm256_srli_epi32(alphas, 24), _mm256_set1_epi32(0xff));
+    const __m256i gray_ok = _mm256_cmpeq_epi32(chroma, _mm256_setzero_si256());
+    opaque = opaque && (_mm256_movemask_epi8(alpha_ok) == -1);
+    gray = gray && (_mm256_movemask_epi8(gray_ok) == -1);
+  }
+  if (opaque || gray)
+    opaque_gray_sse2(pixels + i, n - i, opaque, gray);
+}
+
+__attribute__((target("avx2"))) __m256i merge_pairs_avx2(__m256i v0, __m256i v1, int shift)
+{
+  const __m256i low = _mm256_set1_epi16(0xff);
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  const __m256i m0 =
+      _mm256_or_si256(_mm256_sll_epi16(_mm256_and_si256(v0, low), count), _mm256_srli_epi16(v0, 8));
+  const __m256i m1 =
+      _mm256_or_si256(_mm256_sll_epi16(_mm256_and_si256(v1, low), count), _mm256_srli_epi16(v1, 8));
+  // Packing interleaves the 128-bit lanes, restore the order
+  return _mm256_permute4x64_epi64(_mm256_packus_epi16(m0, m1), 0xd8);
+}
+
+__attribute__((target("avx2"))) void pack_avx2(const uint8_t* indices,
+                                               std::size_t n,
+                                               int bits,
+                                               uint8_t* out)
+{
+  const int steps = (bits == 4 ? 1 : bits == 2 ? 2 : 3);
+  const std::size_t block = std::size_t{32} << steps;  // indices per 32 output bytes
+  std::size_t i = 0;
+  for (; i + block <= n; i += block)
+  {
+    __m256i v[8];
+    const int count = 1 << steps;
+    for (int k = 0; k < count; k++)
+      v[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i + 32 * k));
+    for (int shift = bits, m = count; m > 1; shift *= 2, m /= 2)
+      for (int k = 0; k < m / 2; k++)
+        v[k] = merge_pairs_avx2(v[2 * k], v[2 * k + 1], shift);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * bits / 8), v[0]);
+  }
+  pack_sse2(indices + i, n - i, bits, out + i * bits / 8);
+}
+
+__attribute__((target("avx2"))) std::size_t cost_avx2(const uint8_t* data, std::size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum = zero;
+  std::size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    const __m256i absv = _mm256_min_epu8(v, _mm256_sub_epi8(zero, v));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(absv, zero));
+  }
+  uint64_t sums[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums), sum);
+  return sums[0] + sums[1] + sums[2] + sums[3] + cost_scalar(data + i, n - i);
+}
+
+__attribute__((target("avx2"))) void hash_avx2(const uint8_t* data,
+                                               std::size_t stripes,
+                                               uint64_t key[4],
+                                               uint64_t acc[4])
+{
+  __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc));
+  __m256i keys = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key));
+  const __m256i steps = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hash_steps));
+  for (std::size_t s = 0; s < stripes; s++)
+  {
+    const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32 * s));
+    const __m256i k = _mm256_xor_si256(d, keys);
+    sum = _mm256_add_epi64(sum, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32)));
+    sum = _mm256_add_epi64(sum, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+    keys = _mm256_add_epi64(keys, steps);
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), sum);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(key), keys);
+}
+
+#endif
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief True if the CPU supports AVX2
+ */
+// ----------------------------------------------------------------------
+
+bool have_avx2()
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  static const bool result = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+  return result;
+#else
+  return false;
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief True if the CPU supports AVX-512F
+ */
+// ----------------------------------------------------------------------
+
+bool have_avx512()
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  static const bool result = (__builtin_cpu_init(), __builtin_cpu_supports("avx512f") != 0);
+  return result;
+#else
+  return false;
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Length of the run of the given color at the start of the pixels
+ */
+// ----------------------------------------------------------------------
+
+std::size_t color_run(const Color* pixels, std::size_t n, Color color)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    return color_run_avx2(pixels, n, color);
+  return color_run_sse2(pixels, n, color);
+#else
+  return color_run_scalar(pixels, n, color);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether two rows share three consecutive pixels of the given color
+ */
+// ----------------------------------------------------------------------
+
+bool has_solid_triple(const Color* row1, const Color* row2, std::size_t n, Color color)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    return has_solid_triple_avx2(row1, row2, n, color);
+  return has_solid_triple_sse2(row1, row2, n, color);
+#else
+  return triple_scalar(row1, row2, n, color, 0);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the pixels are opaque and whether they are gray
+ */
+// ----------------------------------------------------------------------
+
+void opaque_gray(const Color* pixels, std::size_t n, bool& opaque, bool& gray)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    opaque_gray_avx2(pixels, n, opaque, gray);
+  else
+    opaque_gray_sse2(pixels, n, opaque, gray);
+#else
+  opaque_gray_scalar(pixels, n, opaque, gray);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief PNG Sub filter
+ */
+// ----------------------------------------------------------------------
+
+void png_sub(const uint8_t* row, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    sub_avx2(row, n, bpp, out);
+  else
+    sub_sse2(row, n, bpp, out);
+#else
+  sub_scalar(row, 0, n, bpp, out);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief PNG Up filter
+ */
+// ----------------------------------------------------------------------
+
+void png_up(const uint8_t* row, const uint8_t* prior, std::size_t n, uint8_t* out)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    up_avx2(row, prior, n, out);
+  else
+    up_sse2(row, prior, n, out);
+#else
+  up_scalar(row, prior, 0, n, out);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief PNG Average filter
+ */
+// ----------------------------------------------------------------------
+
+void png_average(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    average_avx2(row, prior, n, bpp, out);
+  else
+    average_sse2(row, prior, n, bpp, out);
+#else
+  average_scalar(row, prior, 0, n, bpp, out);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief PNG Paeth filter
+ */
+// ----------------------------------------------------------------------
+
+void png_paeth(
+    const uint8_t* row, const uint8_t* prior, std::size_t n, std::size_t bpp, uint8_t* out)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    paeth_avx2(row, prior, n, bpp, out);
+  else
+    paeth_sse2(row, prior, n, bpp, out);
+#else
+  paeth_scalar(row, prior, 0, n, bpp, out);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Pack palette indices into 1, 2 or 4 bits each
+ */
+// ----------------------------------------------------------------------
+
+void pack_indices(const uint8_t* indices, std::size_t n, int bits, uint8_t* out)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    pack_avx2(indices, n, bits, out);
+  else
+    pack_sse2(indices, n, bits, out);
+#else
+  pack_scalar(indices, n, bits, out);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sum of the absolute values of signed filtered bytes
+ */
+// ----------------------------------------------------------------------
+
+std::size_t png_cost(const uint8_t* data, std::size_t n)
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  if (have_avx2())
+    return cost_avx2(data, n);
+  return cost_sse2(data, n);
+#else
+  return cost_scalar(data, n);
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief 128-bit hash of image rows
+ *
+ * Each row is hashed in 32-byte stripes, the last one padded with zeros,
+ * and the lanes are scrambled after each row so that the order of the rows
+ * matters.
+ */
+// ----------------------------------------------------------------------
+
+void hash_rows(
+    const uint8_t* data, std::size_t n, std::size_t rows, std::size_t stride, uint64_t hash[2])
+{
+#ifdef GIZA_HAVE_X86_SIMD
+  auto* const hash_stripes = (have_avx2() ? hash_avx2 : hash_sse2);
+#else
+  auto* const hash_stripes = hash_scalar;
+#endif
+
+  const std::size_t stripes = n / 32;
+  const std::size_t tail = n % 32;
+
+  uint64_t acc[4] = {hash_steps[0], hash_steps[1], hash_steps[2], hash_steps[3]};
+  for (std::size_t j = 0; j < rows; j++)
+  {
+    const uint8_t* row = data + j * stride;
+    uint64_t key[4] = {hash_keys[0], hash_keys[1], hash_keys[2], hash_keys[3]};
+    hash_stripes(row, stripes, key, acc);
+    if (tail > 0)
+    {
+      uint8_t last[32] = {0};
+      std::memcpy(last, row + 32 * stripes, tail);
+      hash_scalar(last, 1, key, acc);
+    }
+    for (int i = 0; i < 4; i++)
+      acc[i] = (acc[i] ^ (acc[i] >> 47) ^ hash_keys[i]) * 0x9e3779b1U;
+  }
+
+  const uint64_t length = static_cast<uint64_t>(n) * rows;
+  hash[0] = hash_mix(acc[0] + hash_mix(acc[1] + hash_mix(acc[2] + hash_mix(acc[3] + length))));
+  hash[1] = hash_mix(acc[3] ^ hash_mix(acc[2] ^ hash_mix(acc[1] ^ hash_mix(acc[0] ^ ~length))));
+}
+
+}  // namespace Simd
+}  // namespace Giza
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ColorTypes.h"
+#include <cstddef>
+#include <cstdint>
+
+// The x86 kernels are compiled with GCC target attributes and selected at
+// runtime, so they are available regardless of the compiler flags
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GIZA_HAVE_X86_SIMD 1
+#endif
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Vectorized pixel kernels
+ *
+ * The kernels use AVX2 or SSE2 when available, selected at runtime on
+ * x86, and fall back to plain loops elsewhere. All variants return
+ * identical results.
+ */
+// ----------------------------------------------------------------------
+
+namespace Giza
+{
+namespace Simd
+{
+// Runtime CPU feature checks shared by all vectorized code. Always false
+// if GIZA_HAVE_X86_SIMD is not defined.
+bool have_avx2();
+bool have_avx512();
+
+// Number of leading pixels equal to color, at most n
+std::size_t color_run(const Color* pixels, std::size_t n, Color color);
+
+// True if some three consecutive columns in [0,n) have the given color on
+// both rows. Used to detect solid 3x3 blocks below a run of three pixels.
+bool has_solid_triple(const Color* row1, const Color* row2, std::size_t n, Color color);
+
+// Clear opaque if some pixel is not fully opaque, and gray if some pixel
+// has differing color components. Returns early once both are cleared.
+void opaque_gray(const Color* pixels, std::size_t n, bool& opaque, bool& gray);
+
+// PNG scanline filters for n bytes of a scanline with bpp bytes per pixel. The
+// prior scanline is the unfiltered previous one, or zeros for the first row.
+void png_sub(const std::uint8_t* row, std::size_t n, std::size_t bpp, std::uint8_t* out);
+void png_up(const std::uint8_t* row, const std::uint8_t* prior, std::size_t n, std::uint8_t* out);
+void png_average(const std::uint8_t* row,
+                 const std::uint8_t* prior,
+                 std::size_t n,
+                 std::size_t bpp,
+                 std::uint8_t* out);
+void png_paeth(const std::uint8_t* row,
+               const std::uint8_t* prior,
+               std::size_t n,
+               std::size_t bpp,
+               std::uint8_t* out);
+
+// Pack n palette indices of 1, 2 or 4 bits into bytes, the first index in the
+// most significant bits as in PNG scanlines. The last byte is padded with zeros.
+void pack_indices(const std::uint8_t* indices, std::size_t n, int bits, std::uint8_t* out);
+
+// Sum of the absolute values of filtered bytes taken as signed, the usual
+// heuristic for choosing the filter of a scanline
+std::size_t png_cost(const std::uint8_t* data, std::size_t n);
+
+// 128-bit hash of rows of n bytes, stride bytes apart. Meant for recognizing
+// repeated images, the hash is fast but not cryptographically strong.
+void hash_rows(const std::uint8_t* data,
+               std::size_t n,
+               std::size_t rows,
+               std::size_t stride,
+               std::uint64_t hash[2]);
+
+}  // namespace Simd
+}  // namespace Giza
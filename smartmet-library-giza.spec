@@ -27,9 +27,11 @@ Requires: librsvg2 >= 2.40.6
 BuildRequires: cairo-devel
 BuildRequires: libwebp13-devel
 BuildRequires: libdeflate-devel
+BuildRequires: zlib-devel
 Requires: cairo
 Requires: libwebp13
 Requires: libdeflate
+Requires: zlib
 Requires: smartmet-library-macgyver >= 26.6.15
 Provides: %{SPECNAME}
 Obsoletes: libsmartmet-giza < 16.12.21
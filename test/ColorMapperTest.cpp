@@ -1,9 +1,13 @@
 #include "ColorMapper.h"
+#include "FixedPalette.h"
+#include "Giza.h"
 #include <filesystem>
 #include <boost/functional/hash.hpp>
 #include <fmt/format.h>
 #include <regression/tframe.h>
 #include <macgyver/StringConversion.h>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <Magick++.h>
@@ -79,6 +83,23 @@ bool checkimage(const std::string& output, const std::string& expected)
 
 namespace Tests
 {
+// Opaque image whose colors are all distinct up to 1024x1024 pixels
+cairo_surface_t* gradient_image(int width, int height)
+{
+  auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  auto* data = cairo_image_surface_get_data(image);
+  const int stride = cairo_image_surface_get_stride(image);
+  for (int j = 0; j < height; j++)
+    for (int i = 0; i < width; i++)
+    {
+      const Giza::Color blue = 16 * (i >> 8) + 64 * (j >> 8);
+      reinterpret_cast<Giza::Color*>(data + j * stride)[i] =
+          0xff000000U | ((i & 0xffU) << 16) | ((j & 0xffU) << 8) | blue;
+    }
+  cairo_surface_mark_dirty(image);
+  return image;
+}
+
 // ----------------------------------------------------------------------
 
 void defaults()
@@ -286,6 +307,454 @@ void transparency()
   TEST_PASSED();
 }
 
+// ----------------------------------------------------------------------
+
+void threads()
+{
+  // The parallel histogram and color replacement must produce exactly the same
+  // result as the serial ones
+
+  std::string infile = "input/quantize1.png";
+
+  auto* image1 = cairo_image_surface_create_from_png(infile.c_str());
+  auto* image2 = cairo_image_surface_create_from_png(infile.c_str());
+
+  Giza::ColorMapOptions options;
+  Giza::ColorMapper mapper1;
+  mapper1.options(options);
+  mapper1.indices(true);
+  mapper1.reduce(image1);
+
+  options.threads = 4;
+  Giza::ColorMapper mapper2;
+  mapper2.options(options);
+  mapper2.indices(true);
+  mapper2.reduce(image2);
+
+  const int height = cairo_image_surface_get_height(image1);
+  const int stride = cairo_image_surface_get_stride(image1);
+  const bool same_pixels = (std::memcmp(cairo_image_surface_get_data(image1),
+                                        cairo_image_surface_get_data(image2),
+                                        static_cast<std::size_t>(height) * stride) == 0);
+
+  cairo_surface_destroy(image1);
+  cairo_surface_destroy(image2);
+
+  if (mapper1.palette() != mapper2.palette())
+    TEST_FAILED("Parallel color reduction produced a different palette");
+
+  if (!same_pixels)
+    TEST_FAILED("Parallel color reduction produced a different image");
+
+  if (mapper1.indices() != mapper2.indices())
+    TEST_FAILED("Parallel color reduction produced different palette indices");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void twophase()
+{
+  // The parallel mapping phase must not depend on the number of threads.
+  // The gradient has enough merged colors to be mapped in several bands.
+
+  auto* image1 = gradient_image(512, 512);
+  auto* image2 = gradient_image(512, 512);
+
+  Giza::ColorMapOptions options;
+  options.twophase = true;
+  options.maxcolors = 256;
+  Giza::ColorMapper mapper1;
+  mapper1.options(options);
+  mapper1.reduce(image1);
+
+  options.threads = 4;
+  Giza::ColorMapper mapper2;
+  mapper2.options(options);
+  mapper2.reduce(image2);
+
+  const int height = cairo_image_surface_get_height(image1);
+  const int stride = cairo_image_surface_get_stride(image1);
+  const bool same_pixels = (std::memcmp(cairo_image_surface_get_data(image1),
+                                        cairo_image_surface_get_data(image2),
+                                        static_cast<std::size_t>(height) * stride) == 0);
+
+  cairo_surface_destroy(image1);
+  cairo_surface_destroy(image2);
+
+  if (mapper1.palette().empty())
+    TEST_FAILED("Two-phase gradient was not reduced to a palette");
+
+  if (mapper1.palette() != mapper2.palette())
+    TEST_FAILED("Parallel two-phase mapping produced a different palette");
+
+  if (!same_pixels)
+    TEST_FAILED("Parallel two-phase mapping produced a different image");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void indices()
+{
+  // The palette indices must select the same colors as in the reduced image
+
+  std::string infile = "input/quantize1.png";
+
+  auto* image = cairo_image_surface_create_from_png(infile.c_str());
+
+  Giza::ColorMapper mapper;
+  mapper.indices(true);
+  mapper.reduce(image);
+
+  const int width = cairo_image_surface_get_width(image);
+  const int height = cairo_image_surface_get_height(image);
+  const int stride = cairo_image_surface_get_stride(image);
+  const unsigned char* data = cairo_image_surface_get_data(image);
+
+  const auto& palette = mapper.palette();
+  const auto& indices = mapper.indices();
+
+  std::size_t errors = 0;
+  if (indices.size() == static_cast<std::size_t>(width) * height)
+  {
+    for (int j = 0; j < height; j++)
+      for (int i = 0; i < width; i++)
+      {
+        Giza::Color color;
+        std::memcpy(&color, data + j * stride + 4 * i, sizeof(color));
+        if (palette.at(indices[j * width + i]) != color)
+          ++errors;
+      }
+  }
+
+  cairo_surface_destroy(image);
+
+  if (indices.size() != static_cast<std::size_t>(width) * height)
+    TEST_FAILED("Expected " + std::to_string(width * height) + " palette indices, got " +
+                std::to_string(indices.size()));
+
+  if (errors > 0)
+    TEST_FAILED(std::to_string(errors) + " pixels have the wrong palette index");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void manycolors()
+{
+  // Color tables for hundreds of thousands of colors are prefetched and
+  // probed differently from small ones, and must still find every color
+
+  auto* original = gradient_image(512, 512);
+  auto* image = gradient_image(512, 512);
+
+  Giza::ColorMapOptions options;
+  options.maxcolors = 256;
+
+  Giza::ColorMapper mapper;
+  mapper.options(options);
+  mapper.indices(true);
+  mapper.reduce(image);
+
+  const auto& colormap = mapper.colormap();
+  const auto& palette = mapper.palette();
+  const auto& indices = mapper.indices();
+
+  const int width = cairo_image_surface_get_width(image);
+  const int height = cairo_image_surface_get_height(image);
+  const int stride = cairo_image_surface_get_stride(image);
+  const auto* data1 = cairo_image_surface_get_data(original);
+  const auto* data2 = cairo_image_surface_get_data(image);
+
+  std::size_t errors = 0;
+  if (colormap.size() == static_cast<std::size_t>(width) * height && !palette.empty() &&
+      indices.size() == static_cast<std::size_t>(width) * height)
+  {
+    for (int j = 0; j < height; j++)
+      for (int i = 0; i < width; i++)
+      {
+        const auto color = reinterpret_cast<const Giza::Color*>(data1 + j * stride)[i];
+        const auto reduced = reinterpret_cast<const Giza::Color*>(data2 + j * stride)[i];
+        const auto expected = colormap.at(color);
+        if (reduced != expected || palette.at(indices[j * width + i]) != expected)
+          ++errors;
+      }
+  }
+  else
+    ++errors;
+
+  cairo_surface_destroy(original);
+  cairo_surface_destroy(image);
+
+  if (errors > 0)
+    TEST_FAILED("Reduced colors or indices differ from the color map for " +
+                std::to_string(errors) + " pixels");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void estimatequality()
+{
+  // The estimated quality must respect maxcolors, using most of the allowed colors
+
+  std::string infile = "input/quantize1.png";
+
+  auto* image = cairo_image_surface_create_from_png(infile.c_str());
+
+  Giza::ColorMapOptions options;
+  options.maxcolors = 100;
+  options.estimatequality = true;
+
+  Giza::ColorMapper mapper;
+  mapper.options(options);
+  mapper.reduce(image);
+
+  cairo_surface_destroy(image);
+
+  const auto colors = mapper.palette().size();
+  if (colors > 100 || colors < 80)
+    TEST_FAILED("Expected 80-100 colors, got " + std::to_string(colors));
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void preserve()
+{
+  // The non-destructive PNG writer must produce the same output as topng
+  // and leave the image untouched
+
+  std::string infile = "input/quantize1.png";
+
+  Giza::ColorMapOptions limited;
+  limited.maxcolors = 100;
+
+  for (const auto& options : {Giza::ColorMapOptions(), limited})
+  {
+    auto* image = cairo_image_surface_create_from_png(infile.c_str());
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    const std::string original(reinterpret_cast<char*>(cairo_image_surface_get_data(image)),
+                               static_cast<std::size_t>(height) * stride);
+
+    const auto preserved = Giza::topng_preserve(image, options);
+    const std::string after(reinterpret_cast<char*>(cairo_image_surface_get_data(image)),
+                            original.size());
+    const auto reduced = Giza::topng(image, options);
+
+    cairo_surface_destroy(image);
+
+    if (after != original)
+      TEST_FAILED("topng_preserve modified the image");
+
+    if (preserved != reduced)
+      TEST_FAILED("topng_preserve output differs from topng output");
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void reusecoverage()
+{
+  // A frame whose colors are all known must be reduced exactly as before,
+  // new colors must be added to the reused color map, and a different
+  // image must get the same color map as with a new mapper
+
+  std::string infile1 = "input/quantize1.png";
+  std::string infile2 = "input/quantize2.png";
+
+  Giza::ColorMapOptions options;
+  options.reusecoverage = 0.9;
+
+  Giza::ColorMapper mapper;
+  mapper.options(options);
+
+  auto* image = cairo_image_surface_create_from_png(infile1.c_str());
+  mapper.reduce(image);
+  const auto palette1 = mapper.palette();
+  cairo_surface_destroy(image);
+
+  image = cairo_image_surface_create_from_png(infile1.c_str());
+  mapper.reduce(image);
+  const auto palette2 = mapper.palette();
+  cairo_surface_destroy(image);
+
+  if (palette2 != palette1)
+    TEST_FAILED("Reused color map changed the colors of the same image");
+
+  // Paint a new color over a small part of the image
+
+  const Giza::Color magenta = 0xffff00ffU;
+  image = cairo_image_surface_create_from_png(infile1.c_str());
+  auto* data = cairo_image_surface_get_data(image);
+  const int stride = cairo_image_surface_get_stride(image);
+  for (int j = 0; j < 20; j++)
+    for (int i = 0; i < 20; i++)
+      reinterpret_cast<Giza::Color*>(data + j * stride)[i] = magenta;
+  cairo_surface_mark_dirty(image);
+  mapper.reduce(image);
+  const auto palette3 = mapper.palette();
+  cairo_surface_destroy(image);
+
+  if (std::find(palette3.begin(), palette3.end(), magenta) == palette3.end())
+    TEST_FAILED("New color was not added to the reused color map");
+
+  image = cairo_image_surface_create_from_png(infile2.c_str());
+  mapper.reduce(image);
+  const auto palette4 = mapper.palette();
+  cairo_surface_destroy(image);
+
+  Giza::ColorMapper newmapper;
+  newmapper.options(options);
+  image = cairo_image_surface_create_from_png(infile2.c_str());
+  newmapper.reduce(image);
+  const auto palette5 = newmapper.palette();
+  cairo_surface_destroy(image);
+
+  if (palette4 != palette5)
+    TEST_FAILED("Color map was reused for a different image");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void truecolorframe()
+{
+  // A true color image must not force true color for the next images
+  // reduced by the same mapper
+
+  std::string infile = "input/quantize1.png";
+
+  Giza::ColorMapOptions options;
+  options.reusecoverage = 0.9;
+
+  Giza::ColorMapper mapper;
+  mapper.options(options);
+
+  // Premultiplied grays with all possible alpha values
+  auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 256, 256);
+  auto* data = cairo_image_surface_get_data(image);
+  const int stride = cairo_image_surface_get_stride(image);
+  for (Giza::Color j = 0; j < 256; j++)
+    for (Giza::Color i = 0; i < 256; i++)
+    {
+      const Giza::Color gray = std::min(i, j);
+      reinterpret_cast<Giza::Color*>(data + j * stride)[i] =
+          (i << 24) | (gray << 16) | (gray << 8) | gray;
+    }
+  cairo_surface_mark_dirty(image);
+  mapper.reduce(image);
+  const bool truecolor1 = mapper.trueColor();
+  cairo_surface_destroy(image);
+
+  image = cairo_image_surface_create_from_png(infile.c_str());
+  mapper.reduce(image);
+  const bool truecolor2 = mapper.trueColor();
+  const auto palette2 = mapper.palette();
+  cairo_surface_destroy(image);
+
+  Giza::ColorMapper newmapper;
+  newmapper.options(options);
+  image = cairo_image_surface_create_from_png(infile.c_str());
+  newmapper.reduce(image);
+  const auto palette3 = newmapper.palette();
+  cairo_surface_destroy(image);
+
+  if (!truecolor1)
+    TEST_FAILED("Image with many alpha values was not reduced in true color");
+  if (truecolor2 || palette2.empty())
+    TEST_FAILED("True color image forced true color for the next image");
+  if (palette2 != palette3)
+    TEST_FAILED("Mapper used for a true color image gave a different palette");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void palette()
+{
+  // A fixed palette must be used as is for all images, its own colors must
+  // be kept, and a mapper reused for several images must give the same
+  // results as a new one
+
+  std::string infile1 = "input/quantize1.png";
+  std::string infile2 = "input/quantize2.png";
+
+  Giza::ColorMapOptions limited;
+  limited.maxcolors = 16;
+
+  Giza::ColorMapper legend;
+  legend.options(limited);
+  auto* image = cairo_image_surface_create_from_png(infile1.c_str());
+  legend.reduce(image);
+  cairo_surface_destroy(image);
+
+  auto colors = legend.palette();
+  std::reverse(colors.begin(), colors.end());
+
+  Giza::ColorMapOptions options;
+  options.palette = std::make_shared<Giza::FixedPalette>(colors);
+
+  Giza::ColorMapper mapper;
+  mapper.options(options);
+  mapper.indices(true);
+
+  for (const auto& infile : {infile1, infile2, infile1})
+  {
+    image = cairo_image_surface_create_from_png(infile.c_str());
+    mapper.reduce(image);
+
+    auto* newimage = cairo_image_surface_create_from_png(infile.c_str());
+    Giza::ColorMapper newmapper;
+    newmapper.options(options);
+    newmapper.reduce(newimage);
+
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    const auto* data = cairo_image_surface_get_data(image);
+    const auto* newdata = cairo_image_surface_get_data(newimage);
+
+    bool indexed = true;
+    for (int j = 0; j < height; j++)
+      for (int i = 0; i < width; i++)
+      {
+        const auto color = reinterpret_cast<const Giza::Color*>(data + j * stride)[i];
+        indexed = indexed && (colors[mapper.indices()[j * width + i]] == color);
+      }
+    const bool same = (std::memcmp(data, newdata, height * stride) == 0);
+
+    cairo_surface_destroy(image);
+    cairo_surface_destroy(newimage);
+
+    if (mapper.palette() != colors)
+      TEST_FAILED("Fixed palette was not used as is for " + infile);
+    if (!indexed)
+      TEST_FAILED("Pixel indices do not match their colors in " + infile);
+    if (!same)
+      TEST_FAILED("Reused mapper and new mapper differ for " + infile);
+  }
+
+  // Palette colors map to themselves
+  std::vector<Giza::Color> nearest(colors.size());
+  options.palette->nearest(colors.data(), colors.size(), nearest.data());
+  if (nearest != colors)
+    TEST_FAILED("Palette colors were not mapped to themselves");
+
+  TEST_PASSED();
+}
+
 // Test driver
 class tests : public tframe::tests
 {
@@ -298,6 +767,15 @@ class tests : public tframe::tests
     TEST(quality);
     TEST(maxcolors);
     TEST(transparency);
+    TEST(threads);
+    TEST(twophase);
+    TEST(indices);
+    TEST(manycolors);
+    TEST(estimatequality);
+    TEST(preserve);
+    TEST(reusecoverage);
+    TEST(truecolorframe);
+    TEST(palette);
   }
 
 };  // class tests
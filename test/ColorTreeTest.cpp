@@ -0,0 +1,62 @@
+#include "ColorTree.h"
+#include <regression/tframe.h>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+namespace Tests
+{
+// ----------------------------------------------------------------------
+
+void batch()
+{
+  // The batch search must give the same results as the single color search
+  // for both scanned small trees and searched large trees
+
+  std::mt19937 rng(1234);
+
+  for (int size : {10, 200, 3000})
+  {
+    Giza::ColorTree tree;
+    for (int i = 0; i < size; i++)
+      tree.insert(rng());
+
+    std::vector<Giza::Color> colors(10000);
+    for (auto& color : colors)
+      color = rng();
+
+    std::vector<Giza::Color> nearest(colors.size());
+    std::vector<double> distances(colors.size());
+    tree.nearest(colors.data(), colors.size(), nearest.data(), distances.data());
+
+    for (std::size_t i = 0; i < colors.size(); i++)
+    {
+      double distance = 0;
+      const auto color = tree.nearest(colors[i], distance);
+      if (color != nearest[i] || distance != distances[i])
+        TEST_FAILED("Batch search differs from single search for tree size " +
+                    std::to_string(size));
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// Test driver
+class tests : public tframe::tests
+{
+  // Overridden message separator
+  virtual const char* error_message_prefix() const { return "\n\t"; }
+  // Main test suite
+  void test() { TEST(batch); }
+};  // class tests
+
+}  // namespace Tests
+
+int main(void)
+{
+  cout << endl << "ColorTree tester" << endl << "================" << endl;
+  Tests::tests t;
+  return t.run();
+}
@@ -0,0 +1,644 @@
+#include "ColorMapper.h"
+#include "Encoder.h"
+#include "FixedPalette.h"
+#include "Giza.h"
+#include "OutputCache.h"
+#include "PngOptions.h"
+#include "WebpOptions.h"
+#include <regression/tframe.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace Tests
+{
+namespace
+{
+cairo_status_t read_string(void* closure, unsigned char* data, unsigned int length)
+{
+  auto* input = static_cast<std::string*>(closure);
+  if (input->size() < length)
+    return CAIRO_STATUS_READ_ERROR;
+  std::memcpy(data, input->data(), length);
+  input->erase(0, length);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+// Decode a PNG and compare its pixels with the given surface
+bool same_pixels(std::string png, cairo_surface_t* image)
+{
+  auto* decoded = cairo_image_surface_create_from_png_stream(read_string, &png);
+  bool ok = (cairo_surface_status(decoded) == CAIRO_STATUS_SUCCESS);
+  if (ok)
+  {
+    cairo_surface_flush(decoded);
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    ok = (cairo_image_surface_get_width(decoded) == width &&
+          cairo_image_surface_get_height(decoded) == height);
+
+    // The image may be a view to a larger image with a different stride
+    const int stride1 = cairo_image_surface_get_stride(decoded);
+    const int stride2 = cairo_image_surface_get_stride(image);
+    for (int j = 0; ok && j < height; j++)
+      ok = (std::memcmp(cairo_image_surface_get_data(decoded) + j * stride1,
+                        cairo_image_surface_get_data(image) + j * stride2,
+                        4 * static_cast<std::size_t>(width)) == 0);
+  }
+  cairo_surface_destroy(decoded);
+  return ok;
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+
+void reuse()
+{
+  // An encoder reused for several images and option sets must produce the
+  // same output as a new encoder for each image
+
+  const std::vector<std::string> infiles = {
+      "input/quantize1.png", "input/quantize2.png", "input/quantize1.png"};
+
+  Giza::ColorMapOptions limited;
+  limited.maxcolors = 100;
+
+  Giza::Encoder encoder;
+  std::string buffer;
+
+  for (const auto& options : {Giza::ColorMapOptions(), limited})
+  {
+    for (const auto& infile : infiles)
+    {
+      auto* image1 = cairo_image_surface_create_from_png(infile.c_str());
+      auto* image2 = cairo_image_surface_create_from_png(infile.c_str());
+      auto* image3 = cairo_image_surface_create_from_png(infile.c_str());
+
+      const auto expected_png = Giza::topng(image1, options);
+      encoder.topng(image2, options, Giza::PngOptions(), buffer);
+      const auto webp = encoder.towebp(image3, options, Giza::WebpOptions());
+
+      cairo_surface_destroy(image1);
+      cairo_surface_destroy(image2);
+      cairo_surface_destroy(image3);
+
+      if (buffer != expected_png)
+        TEST_FAILED("Reused encoder produced a different PNG for " + infile);
+
+      auto* image4 = cairo_image_surface_create_from_png(infile.c_str());
+      const auto expected_webp = Giza::towebp(image4, options);
+      cairo_surface_destroy(image4);
+
+      if (webp != expected_webp)
+        TEST_FAILED("Reused encoder produced a different WebP for " + infile);
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void parallel()
+{
+  // Compressing in parallel chunks must produce a valid PNG with the same
+  // pixels as compressing in one piece
+
+  const std::string infile = "input/quantize2.png";
+
+  Giza::ColorMapOptions truecolor;
+  truecolor.truecolor = true;
+
+  Giza::PngOptions pngOptions;
+  pngOptions.threads = 4;
+  pngOptions.parallelsize = 0;
+
+  for (const auto& options : {Giza::ColorMapOptions(), truecolor})
+  {
+    auto* image1 = cairo_image_surface_create_from_png(infile.c_str());
+    auto* image2 = cairo_image_surface_create_from_png(infile.c_str());
+
+    const auto serial = Giza::topng(image1, options);
+    const auto parallel = Giza::topng(image2, options, pngOptions);
+
+    // The surfaces hold the reduced colors, which the PNGs must reproduce
+    const bool ok1 = same_pixels(serial, image1);
+    const bool ok2 = same_pixels(parallel, image2);
+
+    cairo_surface_destroy(image1);
+    cairo_surface_destroy(image2);
+
+    if (!ok1)
+      TEST_FAILED("Serially compressed PNG does not match the image");
+    if (!ok2)
+      TEST_FAILED("PNG compressed in parallel does not match the image");
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void bands()
+{
+  // Writing the image data in bands must produce a valid PNG with the same
+  // pixels, with and without parallel compression of the bands
+
+  const std::string infile = "input/quantize2.png";
+
+  Giza::ColorMapOptions truecolor;
+  truecolor.truecolor = true;
+
+  for (int threads : {1, 4})
+  {
+    Giza::PngOptions pngOptions;
+    pngOptions.threads = threads;
+    pngOptions.bandsize = 300000;
+
+    for (const auto& options : {Giza::ColorMapOptions(), truecolor})
+    {
+      auto* image = cairo_image_surface_create_from_png(infile.c_str());
+      const auto png = Giza::topng(image, options, pngOptions);
+      const bool ok = same_pixels(png, image);
+      cairo_surface_destroy(image);
+
+      if (!ok)
+        TEST_FAILED("PNG written in bands with " + std::to_string(threads) +
+                    " threads does not match the image");
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void bandedindices()
+{
+  // Palette images larger than the band size are indexed band by band
+  // instead of building an index image. The result must match the image
+  // and the non-destructive encoding with the same color map.
+
+  const std::string infile = "input/quantize2.png";
+
+  Giza::ColorMapOptions limited;
+  limited.maxcolors = 16;
+
+  Giza::ColorMapOptions twophase;
+  twophase.twophase = true;
+  twophase.maxcolors = 64;
+
+  Giza::ColorMapOptions fixed;
+  fixed.palette = std::make_shared<Giza::FixedPalette>(std::vector<Giza::Color>{
+      0xff000000U, 0xffffffffU, 0xffff0000U, 0xff00ff00U, 0xff0000ffU, 0x80808080U});
+
+  Giza::PngOptions pngOptions;
+  pngOptions.bandsize = 100000;
+
+  for (const auto& options : {Giza::ColorMapOptions(), limited, twophase, fixed})
+  {
+    auto* image1 = cairo_image_surface_create_from_png(infile.c_str());
+    auto* image2 = cairo_image_surface_create_from_png(infile.c_str());
+
+    const auto png = Giza::topng(image1, options, pngOptions);
+    const auto expected = Giza::topng_preserve(image2, options, pngOptions);
+    const bool ok = same_pixels(png, image1);
+
+    cairo_surface_destroy(image1);
+    cairo_surface_destroy(image2);
+
+    if (!ok)
+      TEST_FAILED("PNG indexed in bands does not match the reduced image");
+    if (png != expected)
+      TEST_FAILED("PNG indexed in bands differs from the non-destructive PNG");
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void filters()
+{
+  // All scanline filters must reproduce the pixels both when writing the
+  // whole image at once and in bands, and filtering must help compressing
+  // a smooth gradient
+
+  const std::string infile = "input/quantize2.png";
+
+  Giza::ColorMapOptions truecolor;
+  truecolor.truecolor = true;
+
+  const int width = 300;
+  const int height = 200;
+  auto* gradient = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  auto* data = cairo_image_surface_get_data(gradient);
+  const int stride = cairo_image_surface_get_stride(gradient);
+  for (int j = 0; j < height; j++)
+  {
+    auto* row = reinterpret_cast<uint32_t*>(data + j * stride);
+    for (int i = 0; i < width; i++)
+      row[i] = 0xff000000U | ((i * 255 / width) << 16) | ((j * 255 / height) << 8) |
+               ((i + j) * 255 / (width + height));
+  }
+  cairo_surface_mark_dirty(gradient);
+
+  const auto unfiltered = Giza::topng_preserve(gradient, truecolor);
+
+  for (auto filter : {Giza::PngOptions::None,
+                      Giza::PngOptions::Sub,
+                      Giza::PngOptions::Up,
+                      Giza::PngOptions::Average,
+                      Giza::PngOptions::Paeth,
+                      Giza::PngOptions::Adaptive})
+  {
+    const std::string name = std::to_string(filter);
+
+    for (std::size_t bandsize : {std::size_t{64 * 1024 * 1024}, std::size_t{300000}})
+    {
+      Giza::PngOptions pngOptions;
+      pngOptions.filter = filter;
+      pngOptions.bandsize = bandsize;
+
+      auto* image = cairo_image_surface_create_from_png(infile.c_str());
+      const auto png = Giza::topng(image, truecolor, pngOptions);
+      const bool ok = same_pixels(png, image);
+      cairo_surface_destroy(image);
+
+      if (!ok)
+        TEST_FAILED("PNG written with filter " + name + " does not match the image");
+    }
+
+    Giza::PngOptions pngOptions;
+    pngOptions.filter = filter;
+    const auto png = Giza::topng_preserve(gradient, truecolor, pngOptions);
+    if (!same_pixels(png, gradient))
+      TEST_FAILED("Gradient written with filter " + name + " does not match the image");
+    if (filter == Giza::PngOptions::Adaptive && png.size() >= unfiltered.size())
+      TEST_FAILED("Adaptive filtering did not reduce the size of a gradient");
+  }
+
+  cairo_surface_destroy(gradient);
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void depths()
+{
+  // Palette images must be written with the smallest bit depth which fits
+  // the palette, including rows whose indices do not fill the last byte
+
+  const int width = 37;
+  const int height = 23;
+
+  for (int colors : {1, 2, 3, 4, 5, 16, 17})
+  {
+    const int expected = (colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8);
+
+    for (bool preserve : {false, true})
+    {
+      // Colors far apart from each other so that none of them are merged
+      auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+      auto* data = cairo_image_surface_get_data(image);
+      const int stride = cairo_image_surface_get_stride(image);
+      for (int j = 0; j < height; j++)
+      {
+        auto* row = reinterpret_cast<uint32_t*>(data + j * stride);
+        for (int i = 0; i < width; i++)
+        {
+          const int k = (i + 3 * j) % colors;
+          row[i] = 0xff000000U | ((k % 3) * 127 << 16) | ((k / 3 % 3) * 127 << 8) | (k / 9 * 127);
+        }
+      }
+      cairo_surface_mark_dirty(image);
+
+      const auto png = (preserve ? Giza::topng_preserve(image) : Giza::topng(image));
+      const bool ok = same_pixels(png, image);
+      cairo_surface_destroy(image);
+
+      const std::string name = std::to_string(colors) + " colors";
+      if (!ok)
+        TEST_FAILED("PNG with " + name + " does not match the image");
+      if (png.size() < 26 || png[24] != expected)
+        TEST_FAILED("Wrong bit depth for " + name);
+      if (png[25] != 3)
+        TEST_FAILED("PNG with " + name + " is not a palette image");
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void colortypes()
+{
+  // True color images must be written without the alpha channel when they
+  // are opaque and as gray when the color components are equal. Images
+  // with varying alpha are written in true color even without forcing it.
+
+  Giza::ColorMapOptions truecolor;
+  truecolor.truecolor = true;
+
+  struct Case
+  {
+    const char* name;
+    bool opaque;
+    bool gray;
+    int colortype;
+  };
+
+  for (const auto& c : {Case{"gray", true, true, 0},
+                        Case{"RGB", true, false, 2},
+                        Case{"gray+alpha", false, true, 4},
+                        Case{"RGBA", false, false, 6}})
+  {
+    for (const auto& options : {Giza::ColorMapOptions(), truecolor})
+    {
+      if (c.opaque && !options.truecolor)
+        continue;
+
+      const int width = 256;
+      const int height = 100;
+      auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+      auto* data = cairo_image_surface_get_data(image);
+      const int stride = cairo_image_surface_get_stride(image);
+      for (int j = 0; j < height; j++)
+      {
+        auto* row = reinterpret_cast<uint32_t*>(data + j * stride);
+        for (int i = 0; i < width; i++)
+        {
+          // Premultiplied components of an unpremultiplied color
+          const uint32_t a = (c.opaque ? 255 : 55 + 2 * j);
+          const uint32_t r = i * a / 255;
+          const uint32_t g = (c.gray ? i : (i + 7 * j) % 256) * a / 255;
+          const uint32_t b = (c.gray ? i : (3 * j) % 256) * a / 255;
+          row[i] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+      }
+      cairo_surface_mark_dirty(image);
+
+      const auto png = Giza::topng(image, options);
+      const bool ok = same_pixels(png, image);
+      cairo_surface_destroy(image);
+
+      const std::string name = c.name;
+      if (!ok)
+        TEST_FAILED(name + " PNG does not match the image");
+      if (png.size() < 26 || png[25] != c.colortype)
+        TEST_FAILED(name + " image has the wrong PNG color type");
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void uniform()
+{
+  // Single color images take a shortcut, which must produce the same pixels
+  // with and without the encoded data being cached. A single different
+  // pixel must not be lost.
+
+  for (uint32_t color : {0x00000000U, 0xff336699U, 0x80402010U})
+  {
+    for (int different : {0, 1})
+    {
+      std::string previous_png;
+      std::string previous_webp;
+
+      for (int repeat = 0; repeat < 2; repeat++)
+      {
+        auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 77, 33);
+        auto* data = cairo_image_surface_get_data(image);
+        const int stride = cairo_image_surface_get_stride(image);
+        for (int j = 0; j < 33; j++)
+        {
+          auto* row = reinterpret_cast<uint32_t*>(data + j * stride);
+          for (int i = 0; i < 77; i++)
+            row[i] = color;
+        }
+        if (different != 0)
+          reinterpret_cast<uint32_t*>(data + 32 * stride)[76] = 0xffffffffU;
+        cairo_surface_mark_dirty(image);
+
+        // WebP output is converted in place, hence it is done last
+        const auto png = Giza::topng_preserve(image);
+        const bool ok = same_pixels(png, image);
+        const auto webp = Giza::towebp(image);
+        cairo_surface_destroy(image);
+
+        const std::string name = (different != 0 ? "Nearly uniform" : "Uniform");
+        if (!ok)
+          TEST_FAILED(name + " PNG does not match the image");
+        if (repeat > 0 && (png != previous_png || webp != previous_webp))
+          TEST_FAILED(name + " image was encoded differently the second time");
+        previous_png = png;
+        previous_webp = webp;
+      }
+    }
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void uniformpaths()
+{
+  // The single color shortcut must write the same bytes as the regular
+  // writer, also with options which make the regular writer split the data
+
+  Giza::PngOptions parallel;
+  parallel.threads = 4;
+  parallel.parallelsize = 0;
+
+  Giza::PngOptions banded;
+  banded.bandsize = 100000;
+
+  for (const auto& pngOptions : {Giza::PngOptions(), parallel, banded})
+  {
+    auto* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 2000, 2000);
+    auto* data = cairo_image_surface_get_data(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    for (int j = 0; j < 2000; j++)
+    {
+      auto* row = reinterpret_cast<uint32_t*>(data + j * stride);
+      std::fill(row, row + 2000, 0xff336699U);
+    }
+    cairo_surface_mark_dirty(image);
+
+    Giza::ColorMapper mapper;
+    mapper.analyze(image);
+    Giza::Encoder encoder;
+    std::string expected;
+    encoder.topng_mapped(image, mapper, pngOptions, expected);
+
+    const auto png1 = Giza::topng_preserve(image, Giza::ColorMapOptions(), pngOptions);
+    const auto png2 = Giza::topng(image, Giza::ColorMapOptions(), pngOptions);
+    cairo_surface_destroy(image);
+
+    if (png1 != expected || png2 != expected)
+      TEST_FAILED("Single color image was encoded differently from the regular writer");
+  }
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void cache()
+{
+  // Cached outputs must equal the encoded ones, and the least recently
+  // used outputs must be discarded first
+
+  auto& cache = Giza::OutputCache::instance();
+  cache.maxsize(10 * 1024 * 1024);
+
+  const std::string infile = "input/quantize1.png";
+  Giza::ColorMapOptions limited;
+  limited.maxcolors = 16;
+
+  auto* image1 = cairo_image_surface_create_from_png(infile.c_str());
+  auto* image2 = cairo_image_surface_create_from_png(infile.c_str());
+  const auto png1 = Giza::topng_preserve(image1);
+  const auto size1 = cache.size();
+  const auto png2 = Giza::topng_preserve(image2);
+  const auto size2 = cache.size();
+  const auto png3 = Giza::topng_preserve(image2, limited);
+  const auto webp1 = Giza::towebp(image1);
+  const auto webp2 = Giza::towebp(image2);
+  cairo_surface_destroy(image1);
+  cairo_surface_destroy(image2);
+
+  cache.maxsize(0);
+
+  if (size1 == 0 || size2 != size1)
+    TEST_FAILED("Encoded PNG was not cached exactly once");
+  if (png2 != png1)
+    TEST_FAILED("Cached PNG differs from the encoded one");
+  if (png3 == png1)
+    TEST_FAILED("Color reduction options were ignored in the cache key");
+  if (webp2 != webp1)
+    TEST_FAILED("Cached WebP differs from the encoded one");
+  if (cache.size() != 0)
+    TEST_FAILED("Disabling the cache did not empty it");
+
+  Giza::OutputCache lru(1000);
+  const std::string value(300, 'x');
+  lru.insert("a", value);
+  lru.insert("b", value);
+  std::string buffer;
+  if (!lru.find("a", buffer) || buffer != value)
+    TEST_FAILED("Cached value not found");
+  lru.insert("c", value);
+  if (lru.find("b", buffer) || !lru.find("a", buffer) || !lru.find("c", buffer))
+    TEST_FAILED("The least recently used value was not discarded first");
+  lru.insert("d", std::string(1000, 'x'));
+  if (lru.find("d", buffer))
+    TEST_FAILED("Value larger than the cache was stored");
+
+  TEST_PASSED();
+}
+
+// ----------------------------------------------------------------------
+
+void tiles()
+{
+  // Each tile must have the pixels of the image reduced as a whole, and
+  // identical tiles must share their data
+
+  const std::string infile = "input/quantize1.png";
+
+  for (int threads : {1, 4})
+  {
+    Giza::ColorMapOptions options;
+    options.threads = threads;
+
+    auto* image = cairo_image_surface_create_from_png(infile.c_str());
+    const int width = cairo_image_surface_get_width(image);
+    const int height = cairo_image_surface_get_height(image);
+    const int stride = cairo_image_surface_get_stride(image);
+    auto* data = cairo_image_surface_get_data(image);
+
+    // Blank out the top rows, which makes the top tiles identical
+    const int tilesize = 64;
+    std::memset(data, 0, static_cast<std::size_t>(tilesize) * stride);
+    cairo_surface_mark_dirty(image);
+
+    const auto result = Giza::encodeTiles(image, tilesize, options);
+
+    Giza::ColorMapper mapper;
+    mapper.options(options);
+    mapper.reduce(image);
+
+    const int columns = (width + tilesize - 1) / tilesize;
+    const int rows = (height + tilesize - 1) / tilesize;
+    bool ok = (result.columns == columns && result.rows == rows &&
+               result.tiles.size() == static_cast<std::size_t>(columns * rows));
+    bool shared = true;
+
+    for (int row = 0; ok && row < rows; row++)
+      for (int column = 0; ok && column < columns; column++)
+      {
+        const int x = column * tilesize;
+        const int y = row * tilesize;
+        auto* view = cairo_image_surface_create_for_data(data + y * stride + 4 * x,
+                                                         CAIRO_FORMAT_ARGB32,
+                                                         std::min(tilesize, width - x),
+                                                         std::min(tilesize, height - y),
+                                                         stride);
+        ok = same_pixels(*result.tiles[row * columns + column], view);
+        cairo_surface_destroy(view);
+        if (row == 0 && column > 0 && column < columns - 1)
+          shared = shared && (result.tiles[column] == result.tiles[0]);
+      }
+
+    cairo_surface_destroy(image);
+
+    if (!ok)
+      TEST_FAILED("Tiles do not match the image with " + std::to_string(threads) + " threads");
+    if (!shared)
+      TEST_FAILED("Identical tiles do not share their data");
+  }
+
+  TEST_PASSED();
+}
+
+// Test driver
+class tests : public tframe::tests
+{
+  // Overridden message separator
+  virtual const char* error_message_prefix() const { return "\n\t"; }
+  // Main test suite
+  void test()
+  {
+    TEST(reuse);
+    TEST(parallel);
+    TEST(bands);
+    TEST(bandedindices);
+    TEST(filters);
+    TEST(depths);
+    TEST(colortypes);
+    TEST(uniform);
+    TEST(uniformpaths);
+    TEST(cache);
+    TEST(tiles);
+  }
+};  // class tests
+
+}  // namespace Tests
+
+int main(void)
+{
+  cout << endl << "Encoder tester" << endl << "==============" << endl;
+  Tests::tests t;
+  return t.run();
+}